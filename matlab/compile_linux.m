@@ -1,5 +1,5 @@
 disp('compiling micstasy interface for matlab... ') 
-mex micstasy.c ../micstasyc.c -lportmidi 
+mex micstasy.c ../micstasyc.c ../micstasysim.c -lportmidi -lpthread 
 if exist('micstasy') 
 disp('micstasy matlab interface compiled successfully !')
 end
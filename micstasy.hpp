@@ -0,0 +1,454 @@
+/*
+  C++20 coroutine front end for micstasyc
+
+  Operations are awaitables built on the micstasy_async_x() API. The blocking
+  MIDI work runs on the worker thread of each bus, coroutines are resumed on
+  the thread running micstasypp::loop, so one loop drives any number of units
+  and ports:
+
+	micstasypp::task<void> run(micstasypp::unit &unit, const micstasy_scene *scene)
+	{
+		double db = co_await unit.gain(3);
+		co_await unit.set_gain(3, db + 6);
+		co_await unit.apply(scene);
+	}
+
+	micstasypp::loop loop;
+	micstasypp::bus bus(in, out);
+	micstasypp::unit unit(loop, bus, 0, 0);
+	loop.spawn(run(unit, scene));
+	loop.run();
+
+  Failed operations throw micstasypp::error. An exception a spawned task
+  does not catch ends up in loop::run(), which rethrows the first one after
+  every task has finished.
+
+  micstasypp::bus can also take over a bus opened by the C API, for
+  example micstasy_bus_open_sim() or micstasy_bus_open_rawmidi().
+
+  Operations on one bus still run one at a time on its worker thread, so
+  a unit that times out delays the other units' operations on that bus;
+  only operations on different buses wait concurrently.
+*/
+
+#ifndef MICSTASY_HPP
+	#define MICSTASY_HPP
+
+	#include "micstasyc.h"
+
+	#include <condition_variable>
+	#include <coroutine>
+	#include <deque>
+	#include <exception>
+	#include <mutex>
+	#include <stdexcept>
+	#include <type_traits>
+	#include <utility>
+
+namespace micstasypp {
+
+	class error : public std::runtime_error
+	{
+	public:
+		error(int code, const char *message) : std::runtime_error(message), code_(code) {}
+
+		int code() const { return code_; }
+
+	private:
+		int code_;
+	};
+
+
+	/* resumes coroutines whose operations completed; run() returns once
+	   every spawned task has finished and rethrows the first exception a
+	   task let escape */
+	class loop
+	{
+	public:
+		loop() = default;
+		loop(const loop &) = delete;
+		loop &operator=(const loop &) = delete;
+
+		template<class Task>
+		void spawn(Task task)
+		{
+			detached(std::move(task));
+		}
+
+		void run()
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+
+			while(running_ > 0 || !ready_.empty())
+			{
+				cond_.wait(lock, [this] { return !ready_.empty() || running_ == 0; });
+
+				while(!ready_.empty())
+				{
+					std::coroutine_handle<> handle = ready_.front();
+					ready_.pop_front();
+
+					lock.unlock();
+					handle.resume();
+					lock.lock();
+				}
+			}
+
+			if(exception_)
+				std::rethrow_exception(std::exchange(exception_, nullptr));
+		}
+
+		/* thread safe, called from the bus worker threads */
+		void post(std::coroutine_handle<> handle)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				ready_.push_back(handle);
+			}
+			cond_.notify_one();
+		}
+
+	private:
+		struct detached_task {
+			struct promise_type {
+				detached_task get_return_object() { return {}; }
+				std::suspend_never initial_suspend() noexcept { return {}; }
+				std::suspend_never final_suspend() noexcept { return {}; }
+				void return_void() {}
+				void unhandled_exception() { std::terminate(); }
+			};
+		};
+
+		template<class Task>
+		detached_task detached(Task task)
+		{
+			started();
+			try {
+				co_await std::move(task);
+			}
+			catch(...) {
+				failed(std::current_exception());
+			}
+			finished();
+		}
+
+		void failed(std::exception_ptr exception)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if(!exception_)
+				exception_ = exception;
+		}
+
+		void started()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			running_++;
+		}
+
+		void finished()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			running_--;
+			cond_.notify_one();
+		}
+
+		std::mutex mutex_;
+		std::condition_variable cond_;
+		std::deque<std::coroutine_handle<> > ready_;
+		int running_ = 0;
+		std::exception_ptr exception_;
+	};
+
+
+	/* lazily started coroutine, resumes its awaiter when done */
+	template<class T>
+	class task;
+
+	namespace detail {
+
+		/* hands control back to whoever awaited the finished task */
+		struct final_awaiter {
+			bool await_ready() noexcept { return false; }
+
+			template<class Promise>
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+			{
+				if(handle.promise().continuation)
+					return handle.promise().continuation;
+				return std::noop_coroutine();
+			}
+
+			void await_resume() noexcept {}
+		};
+
+		template<class T>
+		struct promise_base {
+			std::coroutine_handle<> continuation;
+			std::exception_ptr exception;
+
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			final_awaiter final_suspend() noexcept { return {}; }
+
+			void unhandled_exception() { exception = std::current_exception(); }
+		};
+
+		template<class T>
+		struct promise : promise_base<T> {
+			T value;
+
+			task<T> get_return_object();
+			void return_value(T v) { value = std::move(v); }
+		};
+
+		template<>
+		struct promise<void> : promise_base<void> {
+			task<void> get_return_object();
+			void return_void() {}
+		};
+	}
+
+	template<class T>
+	class task
+	{
+	public:
+		using promise_type = detail::promise<T>;
+
+		explicit task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+		task(task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+		task(const task &) = delete;
+		~task() { if(handle_) handle_.destroy(); }
+
+		bool await_ready() const noexcept { return false; }
+
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+		{
+			handle_.promise().continuation = awaiter;
+			return handle_;
+		}
+
+		T await_resume()
+		{
+			if(handle_.promise().exception)
+				std::rethrow_exception(handle_.promise().exception);
+			if constexpr (!std::is_void_v<T>)
+				return std::move(handle_.promise().value);
+		}
+
+	private:
+		std::coroutine_handle<promise_type> handle_;
+	};
+
+	namespace detail {
+
+		template<class T>
+		task<T> promise<T>::get_return_object()
+		{
+			return task<T>(std::coroutine_handle<promise<T> >::from_promise(*this));
+		}
+
+		inline task<void> promise<void>::get_return_object()
+		{
+			return task<void>(std::coroutine_handle<promise<void> >::from_promise(*this));
+		}
+	}
+
+
+	/* one micstasy_async_x() call; Submit queues it with the given callback
+	   and user data, Result picks the return value out of the completion */
+	template<class T, class Submit, class Result>
+	class operation
+	{
+	public:
+		operation(class loop &loop, Submit submit, Result result)
+			: loop_(loop), submit_(std::move(submit)), result_(std::move(result)) {}
+
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			handle_ = handle;
+
+			if(submit_(&operation::completed, this) == -1) {
+				completion_.status = -1;
+				completion_.errorCode = micstasy_errorCode();
+				completion_.errorMessage = micstasy_errorMessage();
+				loop_.post(handle);
+			}
+		}
+
+		T await_resume()
+		{
+			if(completion_.status != 1)
+				throw error(completion_.errorCode, completion_.errorMessage);
+
+			return result_(completion_);
+		}
+
+	private:
+		static void completed(const struct micstasy_completion *completion)
+		{
+			operation *self = static_cast<operation *>(completion->userData);
+
+			self->completion_ = *completion;
+			self->loop_.post(self->handle_);
+		}
+
+		class loop &loop_;
+		Submit submit_;
+		Result result_;
+		std::coroutine_handle<> handle_;
+		struct micstasy_completion completion_ = {};
+	};
+
+	template<class T, class Submit, class Result>
+	operation<T, Submit, Result> make_operation(class loop &loop, Submit submit, Result result)
+	{
+		return operation<T, Submit, Result>(loop, std::move(submit), std::move(result));
+	}
+
+
+	/* owns a port pair, or any bus opened by the C API */
+	class bus
+	{
+	public:
+		bus(int midiDeviceIn, int midiDeviceOut) : bus_(micstasy_bus_open(midiDeviceIn, midiDeviceOut))
+		{
+			if(bus_ == NULL)
+				throw error(micstasy_errorCode(), micstasy_errorMessage());
+		}
+
+		/* takes over the bus, pass the result of micstasy_bus_open_x() directly */
+		explicit bus(struct micstasy_bus *adopted) : bus_(adopted)
+		{
+			if(bus_ == NULL)
+				throw error(micstasy_errorCode(), micstasy_errorMessage());
+		}
+
+		bus(const bus &) = delete;
+		bus &operator=(const bus &) = delete;
+		~bus() { micstasy_bus_close(bus_); }
+
+		struct micstasy_bus *get() const { return bus_; }
+
+	private:
+		struct micstasy_bus *bus_;
+	};
+
+
+	/* one unit on a bus; must not outlive its bus */
+	class unit
+	{
+	public:
+		unit(class loop &loop, class bus &bus, int bankNumber, int deviceID)
+			: loop_(loop), unit_(micstasy_bus_unit(bus.get(), bankNumber, deviceID))
+		{
+			if(unit_ == NULL)
+				throw error(micstasy_errorCode(), micstasy_errorMessage());
+		}
+
+		unit(const unit &) = delete;
+		unit &operator=(const unit &) = delete;
+		~unit() { micstasy_close(unit_); }
+
+		struct micstasy *get() const { return unit_; }
+
+		auto gain(int channel)
+		{
+			return make_operation<double>(loop_,
+				[=, this](micstasy_async_callback cb, void *ud) { return micstasy_async_get_gain(unit_, channel, cb, ud); },
+				[](const struct micstasy_completion &c) { return c.value.gain; });
+		}
+
+		auto set_gain(int channel, double dbValue)
+		{
+			return make_operation<void>(loop_,
+				[=, this](micstasy_async_callback cb, void *ud) { return micstasy_async_set_gain(unit_, channel, dbValue, cb, ud); },
+				[](const struct micstasy_completion &) {});
+		}
+
+		auto gainCoarse(int channel)
+		{
+			return make_operation<int>(loop_,
+				[=, this](micstasy_async_callback cb, void *ud) { return micstasy_async_get_gainCoarse(unit_, channel, cb, ud); },
+				[](const struct micstasy_completion &c) { return c.value.gainCoarse; });
+		}
+
+		auto set_gainCoarse(int channel, int dbValue)
+		{
+			return make_operation<void>(loop_,
+				[=, this](micstasy_async_callback cb, void *ud) { return micstasy_async_set_gainCoarse(unit_, channel, dbValue, cb, ud); },
+				[](const struct micstasy_completion &) {});
+		}
+
+		auto parameters(int channel)
+		{
+			return make_operation<struct micstasy_parameters>(loop_,
+				[=, this](micstasy_async_callback cb, void *ud) { return micstasy_async_get_parameters(unit_, channel, cb, ud); },
+				[](const struct micstasy_completion &c) { return c.value.parameters; });
+		}
+
+		auto set_parameters(const struct micstasy_parameters &parameters)
+		{
+			return make_operation<void>(loop_,
+				[=, this](micstasy_async_callback cb, void *ud) { return micstasy_async_set_parameters(unit_, &parameters, cb, ud); },
+				[](const struct micstasy_completion &) {});
+		}
+
+		auto settings(int channel)
+		{
+			return make_operation<struct micstasy_settings>(loop_,
+				[=, this](micstasy_async_callback cb, void *ud) { return micstasy_async_get_settings(unit_, channel, cb, ud); },
+				[](const struct micstasy_completion &c) { return c.value.settings; });
+		}
+
+		auto set_settings(const struct micstasy_settings &settings)
+		{
+			return make_operation<void>(loop_,
+				[=, this](micstasy_async_callback cb, void *ud) { return micstasy_async_set_settings(unit_, &settings, cb, ud); },
+				[](const struct micstasy_completion &) {});
+		}
+
+		auto setup()
+		{
+			return make_operation<struct micstasy_setup>(loop_,
+				[=, this](micstasy_async_callback cb, void *ud) { return micstasy_async_get_setup(unit_, cb, ud); },
+				[](const struct micstasy_completion &c) { return c.value.setup; });
+		}
+
+		auto set_setup(const struct micstasy_setup &setup)
+		{
+			return make_operation<void>(loop_,
+				[=, this](micstasy_async_callback cb, void *ud) { return micstasy_async_set_setup(unit_, &setup, cb, ud); },
+				[](const struct micstasy_completion &) {});
+		}
+
+		auto locksyncInfo()
+		{
+			return make_operation<struct micstasy_locksyncInfo>(loop_,
+				[=, this](micstasy_async_callback cb, void *ud) { return micstasy_async_get_locksyncInfo(unit_, cb, ud); },
+				[](const struct micstasy_completion &c) { return c.value.locksyncInfo; });
+		}
+
+		auto levelMeterData()
+		{
+			return make_operation<struct micstasy_levelMeterData>(loop_,
+				[=, this](micstasy_async_callback cb, void *ud) { return micstasy_async_get_levelMeterData(unit_, cb, ud); },
+				[](const struct micstasy_completion &c) { return c.value.levelMeterData; });
+		}
+
+		/* scene must stay valid until the operation completes */
+		auto apply(const struct micstasy_scene *scene, bool delta = true)
+		{
+			return make_operation<void>(loop_,
+				[=, this](micstasy_async_callback cb, void *ud) { return micstasy_async_scene_apply(unit_, scene, delta, cb, ud); },
+				[](const struct micstasy_completion &) {});
+		}
+
+	private:
+		class loop &loop_;
+		struct micstasy *unit_;
+	};
+
+}
+
+#endif
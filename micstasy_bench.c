@@ -0,0 +1,298 @@
+/*
+  Latency and throughput benchmark for micstasyc
+
+  Copyright (c) 2014, Gerrit Wyen <gerrit.wyen@rwth-aachen.de>, Florian Heese <heese@ind.rwth-aachen.de>
+  Institute of Communication Systems and Data Processing
+  RWTH Aachen University, Germany
+
+  usage: micstasy_bench [iterations]				simulated units
+         micstasy_bench iterations midiIn midiOut bank device	real unit
+         micstasy_bench replay traceFile			recorded session
+
+  Prints one JSON object per backend and operation:
+  {"backend":"sim","op":"get_gain","n":100,"errors":0,"timeouts":0,"latency":"reply","p50_us":..,"p99_us":..,"ops_per_sec":..}
+
+  "sim" runs at MIDI wire speed, "sim-nowire" without wire delay, so the
+  library's own overhead shows up. Set operations return once their
+  message is queued: their p50/p99 are "latency":"queued", and ops_per_sec
+  includes one extra get_setup at the end that waits until the queued
+  messages are on the wire. Request operations are timed until the reply
+  ("latency":"reply"). A last line per backend holds the bus statistics
+  (micstasy_get_stats).
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "micstasyc.h"
+#include "micstasysim.h"
+
+#define BENCH_STATE_FILE "micstasy_bench.state"
+#define BENCH_DEFAULT_ITERATIONS 100
+#define BENCH_TIMEOUT 1000		/* ms per request */
+#define BENCH_DRAIN_TIMEOUT 60000	/* ms, for the backlog of set operations */
+
+
+static int compare_us(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+/* one call of each benchmarked operation, i varies the values written */
+
+static int op_get_gain(struct micstasy *unit, int i)
+{
+	double dbValue;
+
+	(void)i;
+
+	return micstasy_get_gain(unit, 1, &dbValue) == -1 ? -1 : 1;
+}
+
+static int op_set_gain(struct micstasy *unit, int i)
+{
+	return micstasy_set_gain(unit, 1, (i%2) ? 20.5 : 30);
+}
+
+static int op_get_settings(struct micstasy *unit, int i)
+{
+	struct micstasy_settings settings;
+
+	(void)i;
+
+	return micstasy_get_settings(unit, 1, &settings);
+}
+
+static int op_set_settings(struct micstasy *unit, int i)
+{
+	return micstasy_set_settings(unit, 1, 0, 0, 0, i%2, 0, 0, 0);
+}
+
+static int op_get_setup(struct micstasy *unit, int i)
+{
+	struct micstasy_setup setup;
+
+	(void)i;
+
+	return micstasy_get_setup(unit, &setup);
+}
+
+static int op_store_state(struct micstasy *unit, int i)
+{
+	(void)i;
+
+	return micstasy_store_state(unit, BENCH_STATE_FILE);
+}
+
+static int op_restore_state(struct micstasy *unit, int i)
+{
+	(void)i;
+
+	return micstasy_restore_state(unit, BENCH_STATE_FILE);
+}
+
+static int op_get_levelMeterData(struct micstasy *unit, int i)
+{
+	struct micstasy_levelMeterData levelMeterData;
+
+	(void)i;
+
+	return micstasy_get_levelMeterData(unit, &levelMeterData);
+}
+
+
+struct bench_op {
+	const char *name;
+	int (*run)(struct micstasy *unit, int i);
+	boolean set;		/* returns before its messages are on the wire */
+};
+
+/* store_state goes first, restore_state reads its file */
+static const struct bench_op ops[] = {
+	{ "get_gain", op_get_gain, 0 },
+	{ "set_gain", op_set_gain, 1 },
+	{ "get_settings", op_get_settings, 0 },
+	{ "set_settings", op_set_settings, 1 },
+	{ "get_setup", op_get_setup, 0 },
+	{ "store_state", op_store_state, 0 },
+	{ "restore_state", op_restore_state, 1 },
+	{ "get_levelMeterData", op_get_levelMeterData, 0 },
+	{ NULL, NULL, 0 }
+};
+
+
+/* set operations return once their message is queued, a request is only
+   answered after everything sent before it: waiting for one puts the
+   backlog's wire time into the set operations' throughput */
+static void drain(struct micstasy *unit)
+{
+	struct micstasy_setup setup;
+
+	micstasy_set_timeout(unit, BENCH_DRAIN_TIMEOUT);
+	micstasy_get_setup(unit, &setup);
+	micstasy_set_timeout(unit, BENCH_TIMEOUT);
+}
+
+
+static void bench(const char *backend, struct micstasy *unit, const struct bench_op *op, int iterations)
+{
+	uint64_t *latency = (uint64_t *) malloc(iterations*sizeof(uint64_t));
+	struct micstasy_stats stats;
+	uint64_t start, t, timeouts;
+	int i, errors = 0;
+
+	/* get_levelMeterData has no error return, its timeouts show up here */
+	micstasy_get_stats(unit->bus, &stats, 0);
+	timeouts = stats.timeouts;
+
+	start = micstasy_clock_us();
+
+	for(i=0; i<iterations; i++)
+	{
+		t = micstasy_clock_us();
+		if(op->run(unit, i) == -1)
+			errors++;
+		latency[i] = micstasy_clock_us() - t;
+	}
+
+	if(op->set)
+		drain(unit);
+
+	t = micstasy_clock_us() - start;
+
+	micstasy_get_stats(unit->bus, &stats, 0);
+	timeouts = stats.timeouts - timeouts;
+
+	qsort(latency, iterations, sizeof(uint64_t), compare_us);
+
+	printf("{\"backend\":\"%s\",\"op\":\"%s\",\"n\":%d,\"errors\":%d,\"timeouts\":%llu,\"latency\":\"%s\",\"p50_us\":%llu,\"p99_us\":%llu,\"ops_per_sec\":%.1f}\n",
+		backend, op->name, iterations, errors, (unsigned long long)timeouts, op->set ? "queued" : "reply",
+		(unsigned long long)latency[iterations/2], (unsigned long long)latency[(iterations*99)/100],
+		t > 0 ? iterations*1000000.0/t : 0);
+	fflush(stdout);
+
+	free(latency);
+}
+
+
+static void print_stats(const char *backend, struct micstasy_bus *bus)
+{
+	struct micstasy_stats stats;
+
+	micstasy_get_stats(bus, &stats, 0);
+
+	printf("{\"backend\":\"%s\",\"stats\":{\"timeouts\":%llu,\"retries\":%llu,\"readOverflows\":%llu,\"incomplete\":%llu,\"discarded\":%llu,"
+		"\"messagesSent\":%llu,\"messagesReceived\":%llu,\"bytesSent\":%llu,\"bytesReceived\":%llu,\"request_p99_us\":%llu,\"set_p99_us\":%llu}}\n",
+		backend, (unsigned long long)stats.timeouts, (unsigned long long)stats.retries, (unsigned long long)stats.readOverflows,
+		(unsigned long long)stats.incomplete, (unsigned long long)stats.discarded,
+		(unsigned long long)stats.messagesSent, (unsigned long long)stats.messagesReceived,
+		(unsigned long long)stats.bytesSent, (unsigned long long)stats.bytesReceived,
+		(unsigned long long)micstasy_stats_percentile(&stats.latency[MICSTASY_STAT_REQUEST], 99),
+		(unsigned long long)micstasy_stats_percentile(&stats.latency[MICSTASY_STAT_SET], 99));
+	fflush(stdout);
+}
+
+
+static void bench_all(const char *backend, struct micstasy *unit, int iterations)
+{
+	int i;
+
+	micstasy_set_timeout(unit, BENCH_TIMEOUT);
+	micstasy_get_stats(unit->bus, NULL, 1);
+
+	for(i=0; ops[i].name != NULL; i++)
+		bench(backend, unit, &ops[i], iterations);
+
+	print_stats(backend, unit->bus);
+}
+
+
+static int bench_sim(const char *backend, int baudRate, int iterations)
+{
+	struct micstasy_simConfig config;
+	struct micstasy_sim *sim;
+	struct micstasy_bus *bus;
+
+	micstasy_sim_defaults(&config);
+	config.baudRate = baudRate;
+	if(baudRate == 0)
+		config.processingUs = 0;
+
+	sim = micstasy_sim_open(&config);
+	micstasy_sim_add_unit(sim, 0, 0);
+	bus = micstasy_bus_open_sim(sim);
+
+	bench_all(backend, micstasy_bus_unit(bus, 0, 0), iterations);
+
+	micstasy_bus_close(bus);
+	micstasy_sim_close(sim);
+
+	return 0;
+}
+
+
+/* replays a micstasy_trace_start() recording as fast as possible */
+static int bench_replay(const char *filePath)
+{
+	struct micstasy_replayResult result;
+
+	if(micstasy_replay(filePath, 0, 1000, &result) == -1) {
+		fprintf(stderr, "%s\n", micstasy_errorMessage());
+		return 1;
+	}
+
+	printf("{\"backend\":\"replay\",\"messages\":%d,\"replies\":%d,\"missed\":%d,\"unanswered\":%d,\"elapsed_us\":%llu,\"request_p99_us\":%llu}\n",
+		result.messagesSent, result.repliesTaken, result.repliesMissed, result.unanswered,
+		(unsigned long long)result.elapsedUs,
+		(unsigned long long)micstasy_stats_percentile(&result.stats.latency[MICSTASY_STAT_REQUEST], 99));
+
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	struct micstasy *unit;
+	int iterations = BENCH_DEFAULT_ITERATIONS;
+
+	if(argc == 3 && strcmp(argv[1], "replay") == 0)
+		return bench_replay(argv[2]);
+
+	if(argc > 1)
+		iterations = atoi(argv[1]);
+
+	if(iterations < 1 || (argc != 1 && argc != 2 && argc != 6)) {
+		fprintf(stderr, "usage: %s [iterations] | iterations midiIn midiOut bank device | replay traceFile\n", argv[0]);
+		return 1;
+	}
+
+	if(argc == 6)
+	{
+		Pm_Initialize();
+
+		unit = micstasy_init(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+		if(unit == NULL) {
+			fprintf(stderr, "%s\n", micstasy_errorMessage());
+			return 1;
+		}
+
+		bench_all("port", unit, iterations);
+		micstasy_close(unit);
+
+		Pm_Terminate();
+	}
+	else
+	{
+		bench_sim("sim", MICSTASY_SIM_BAUD_RATE, iterations);
+		bench_sim("sim-nowire", 0, iterations);
+	}
+
+	remove(BENCH_STATE_FILE);
+
+	return 0;
+}
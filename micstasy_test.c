@@ -0,0 +1,659 @@
+/*
+  Regression tests for micstasyc against the in-process simulator
+
+  Copyright (c) 2014, Gerrit Wyen <gerrit.wyen@rwth-aachen.de>, Florian Heese <heese@ind.rwth-aachen.de>
+  Institute of Communication Systems and Data Processing
+  RWTH Aachen University, Germany
+
+  usage: micstasy_test		run by ctest, exits with the number of failed tests
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "micstasyc.h"
+#include "micstasysim.h"
+
+#define TEST_STATE_FILE "micstasy_test.state"
+#define TEST_TRACE_FILE "micstasy_test.trace"
+#define TEST_SCENE_FILE "micstasy_test.scenes"
+#define TEST_TIMEOUT 200	/* ms, the simulator answers within a few */
+
+#define CHECK(x) do { if(!(x)) { \
+		fprintf(stderr, "%s:%d: check failed: %s (%s)\n", __FILE__, __LINE__, #x, \
+			micstasy_errorMessage() != NULL ? micstasy_errorMessage() : "no error"); \
+		return 1; } } while(0)
+
+
+/* a simulator without wire delay and a bus with units 0/0 and 0/1 */
+struct fixture {
+	struct micstasy_sim *sim;
+	struct micstasy_bus *bus;
+	struct micstasy *unit[2];
+};
+
+static int fixture_open(struct fixture *f)
+{
+	struct micstasy_simConfig config;
+	int i;
+
+	micstasy_sim_defaults(&config);
+	config.baudRate = 0;
+	config.processingUs = 100;
+
+	f->sim = micstasy_sim_open(&config);
+	if(f->sim == NULL)
+		return -1;
+
+	f->bus = micstasy_bus_open_sim(f->sim);
+	if(f->bus == NULL)
+		return -1;
+
+	for(i=0; i<2; i++) {
+		micstasy_sim_add_unit(f->sim, 0, i);
+		f->unit[i] = micstasy_bus_unit(f->bus, 0, i);
+		if(f->unit[i] == NULL)
+			return -1;
+		micstasy_set_timeout(f->unit[i], TEST_TIMEOUT);
+	}
+
+	return 1;
+}
+
+static void fixture_close(struct fixture *f)
+{
+	micstasy_bus_close(f->bus);
+	micstasy_sim_close(f->sim);
+}
+
+
+static int test_get_state(struct fixture *f)
+{
+	struct micstasy_state state;
+	struct micstasy_setup setup;
+	double dbValue;
+
+	micstasy_sim_set_register(f->sim, 0, 0, 3, 9+40);	/* channel 2: 40 dB */
+	micstasy_sim_set_register(f->sim, 0, 0, 4, 0x01);	/* +0.5 dB */
+
+	CHECK(micstasy_get_state(f->unit[0], &state) == 1);
+	CHECK(state.gainCoarse[0] == 0);
+	CHECK(state.gainCoarse[1] == 40);
+	CHECK(state.parameters[1].gainFine == 1);
+
+	CHECK(micstasy_get_gain(f->unit[0], 2, &dbValue) != -1);
+	CHECK(dbValue == 40.5);
+
+	CHECK(micstasy_get_setup(f->unit[0], &setup) == 1);
+
+	return 0;
+}
+
+
+/* messages the bus has sent so far */
+static uint64_t sent(struct micstasy_bus *bus)
+{
+	struct micstasy_stats stats;
+
+	micstasy_get_stats(bus, &stats, 0);
+
+	return stats.messagesSent;
+}
+
+static int test_cache(struct fixture *f)
+{
+	struct micstasy_value value = { 0x01, 0x01 };
+	struct micstasy_parameters parameters;
+	uint64_t n;
+
+	CHECK(micstasy_cache_refresh(f->unit[0]) == -1);
+	CHECK(micstasy_errorCode() == MICSTASY_ERROR_STATE);
+
+	CHECK(micstasy_cache_enable(f->unit[0], 0) == 1);
+
+	n = sent(f->bus);
+	CHECK(micstasy_get_gainCoarse(f->unit[0], 1) == 0);
+	CHECK(sent(f->bus) == n+1);
+
+	/* served from the cache, even though the unit changed */
+	micstasy_sim_set_register(f->sim, 0, 0, 0, 9+50);
+	CHECK(micstasy_get_gainCoarse(f->unit[0], 1) == 0);
+	CHECK(sent(f->bus) == n+1);
+
+	CHECK(micstasy_cache_refresh(f->unit[0]) == 1);
+	CHECK(sent(f->bus) == n+2);
+	CHECK(micstasy_get_gainCoarse(f->unit[0], 1) == 50);
+
+	/* writes go through to the cache */
+	CHECK(micstasy_set_gainCoarse(f->unit[0], 1, 22) == 1);
+	CHECK(micstasy_get_gainCoarse(f->unit[0], 1) == 22);
+	CHECK(sent(f->bus) == n+3);
+
+	/* a write does not tell the level meter bits of a parameters register */
+	CHECK(micstasy_cache_invalidate(f->unit[0]) == 1);
+	CHECK(micstasy_set_values(f->unit[0], &value, 1) == 1);
+	n = sent(f->bus);
+	CHECK(micstasy_get_parameters(f->unit[0], 1, &parameters) != -1);
+	CHECK(sent(f->bus) == n+1);
+	CHECK(parameters.gainFine == 1);
+
+	/* stale after the timeout */
+	CHECK(micstasy_cache_enable(f->unit[0], 20) == 1);
+	n = sent(f->bus);
+	CHECK(micstasy_get_gainCoarse(f->unit[0], 1) == 22);
+	CHECK(micstasy_get_gainCoarse(f->unit[0], 1) == 22);
+	CHECK(sent(f->bus) == n+1);
+	Sleep(40);
+	CHECK(micstasy_get_gainCoarse(f->unit[0], 1) == 22);
+	CHECK(sent(f->bus) == n+2);
+
+	CHECK(micstasy_cache_disable(f->unit[0]) == 1);
+	CHECK(micstasy_get_gainCoarse(f->unit[0], 1) == 22);
+	CHECK(sent(f->bus) == n+3);
+
+	return 0;
+}
+
+
+static int test_set_values(struct fixture *f)
+{
+	struct micstasy_value values[3] = { { 0x00, 9+20 }, { 0x03, 9+30 }, { 0x05, 0x40 } };
+	double dbValue;
+	int pairs;
+
+	/* one pair per message by default, lists where the bus allows them */
+	for(pairs=1; pairs<=MICSTASY_MAX_SET_PAIRS; pairs+=MICSTASY_MAX_SET_PAIRS-1)
+	{
+		CHECK(micstasy_set_max_pairs(f->bus, pairs) == 1);
+		CHECK(micstasy_set_values(f->unit[1], values, 3) == 1);
+		CHECK(micstasy_sim_get_register(f->sim, 0, 1, 0x00) == 9+20);
+		CHECK(micstasy_sim_get_register(f->sim, 0, 1, 0x03) == 9+30);
+		CHECK(micstasy_sim_get_register(f->sim, 0, 1, 0x05) == 0x40);
+	}
+	micstasy_set_max_pairs(f->bus, MICSTASY_DEFAULT_SET_PAIRS);
+
+	CHECK(micstasy_set_gain(f->unit[1], 1, 12.5) == 1);
+	CHECK(micstasy_get_gain(f->unit[1], 1, &dbValue) != -1);
+	CHECK(dbValue == 12.5);
+
+	values[0].parameterNumber = 0x30;
+	CHECK(micstasy_set_values(f->unit[1], values, 1) == -1);
+	CHECK(micstasy_errorCode() == MICSTASY_ERROR_ARGUMENT);
+
+	return 0;
+}
+
+
+static int test_pipeline(struct fixture *f)
+{
+	struct micstasy_request requests[4];
+	int i;
+
+	memset(requests, 0, sizeof(requests));
+	for(i=0; i<4; i++) {
+		requests[i].messageType = MESSAGETYPE_REQUEST_VALUE;
+		requests[i].deviceID = i;
+	}
+	requests[2].messageType = MESSAGETYPE_REQUEST_LEVELMETER_DATA;
+	requests[2].deviceID = 1;
+	requests[3].deviceID = 5;	/* no such unit */
+
+	micstasy_sim_set_register(f->sim, 0, 1, 0, 9+12);
+
+	CHECK(micstasy_pipeline(f->unit[0], requests, 4, 0) == -1);
+	CHECK(micstasy_errorCode() == MICSTASY_ERROR_ARGUMENT);
+
+	CHECK(micstasy_pipeline(f->unit[0], requests, 4, 4) == 3);
+	CHECK(requests[0].status == 1);
+	CHECK(requests[1].status == 1);
+	CHECK(requests[1].state.gainCoarse[0] == 12);
+	CHECK(requests[2].status == 1);
+	CHECK(requests[3].status == -1);
+	CHECK(micstasy_errorCode() == MICSTASY_ERROR_TIMEOUT);
+
+	return 0;
+}
+
+
+/* the reader role moves between the receiver thread and foreground waiters */
+static int test_receiver(struct fixture *f)
+{
+	struct micstasy_request requests[2];
+
+	memset(requests, 0, sizeof(requests));
+	requests[0].messageType = requests[1].messageType = MESSAGETYPE_REQUEST_VALUE;
+	requests[1].deviceID = 1;
+
+	CHECK(micstasy_get_gainCoarse(f->unit[0], 1) == 0);
+
+	CHECK(micstasy_receiver_start(f->unit[0]) == 1);
+	CHECK(micstasy_receiver_start(f->unit[1]) == 1);
+	CHECK(micstasy_set_gainCoarse(f->unit[1], 2, 18) == 1);
+	CHECK(micstasy_get_gainCoarse(f->unit[1], 2) == 18);
+	CHECK(micstasy_pipeline(f->unit[0], requests, 2, 2) == 2);
+	CHECK(micstasy_receiver_stop(f->unit[0]) == 1);
+
+	CHECK(micstasy_get_gainCoarse(f->unit[1], 2) == 18);
+
+	return 0;
+}
+
+
+/* a level meter reply of unit 0/0 whose channels read level index i */
+static void levelMeter_reply(unsigned char *msg)
+{
+	static const unsigned char header[] = { 0xF0, 0x00, 0x20, 0x0D, 0x68, 0x00, 0x31 };
+	int i;
+
+	memcpy(msg, header, sizeof(header));
+	for(i=0; i<8; i++)
+		msg[7+i] = i;
+	msg[15] = 0xF7;
+}
+
+static int test_loopback(struct fixture *f)
+{
+	static const int levels[8] = { -70, -60, -50, -42, -36, -30, -24, -18 };
+	struct micstasy_levelMeterData levelMeterData;
+	struct micstasy_completion completion;
+	struct micstasy_stats stats;
+	struct micstasy_bus *bus;
+	struct micstasy *unit;
+	unsigned char msg[16];
+	int i;
+
+	CHECK(micstasy_loopback_inject(f->bus, msg, 1) == -1);
+
+	bus = micstasy_bus_open_loopback(0);
+	CHECK(bus != NULL);
+	unit = micstasy_bus_unit(bus, 0, 0);
+	CHECK(unit != NULL);
+	micstasy_set_timeout(unit, 20);
+	micstasy_set_retries(unit, 0);
+
+	levelMeter_reply(msg);
+
+	/* a reply from before the request is stale */
+	CHECK(micstasy_loopback_inject(bus, msg, sizeof(msg)) == 1);
+	Sleep(5);
+	micstasy_get_levelMeterData(unit, &levelMeterData);
+	CHECK(micstasy_errorCode() == MICSTASY_ERROR_TIMEOUT);
+	micstasy_get_stats(bus, &stats, 1);
+	CHECK(stats.discarded == 1);
+	CHECK(stats.timeouts == 1);
+
+	/* the receiver thread hands the reply to the async worker */
+	micstasy_set_timeout(unit, 1000);
+	CHECK(micstasy_receiver_start(unit) == 1);
+	CHECK(micstasy_async_get_levelMeterData(unit, NULL, NULL) > 0);
+
+	for(i=0; i<200 && sent(bus) == 0; i++)
+		Sleep(1);
+	CHECK(sent(bus) == 1);
+	Sleep(2);
+	CHECK(micstasy_loopback_inject(bus, msg, sizeof(msg)) == 1);
+
+	CHECK(micstasy_async_wait(bus, &completion, 1000) == 1);
+	CHECK(completion.status == 1);
+	for(i=0; i<8; i++)
+		CHECK(completion.value.levelMeterData.channel[i] == levels[i]);
+
+	CHECK(micstasy_bus_close(bus) == 1);
+
+	return 0;
+}
+
+
+static int test_stats(struct fixture *f)
+{
+	struct micstasy_stats stats;
+	struct micstasy *absent;
+	uint64_t buckets = 0;
+	int i;
+
+	CHECK(micstasy_get_stats(f->bus, NULL, 1) == 1);
+
+	for(i=0; i<3; i++)
+		CHECK(micstasy_get_gainCoarse(f->unit[0], 1) == 0);
+	CHECK(micstasy_set_gainCoarse(f->unit[0], 1, 10) == 1);
+
+	absent = micstasy_bus_unit(f->bus, 0, 5);
+	CHECK(absent != NULL);
+	micstasy_set_timeout(absent, 20);
+	micstasy_set_retries(absent, 1);
+	CHECK(micstasy_get_gainCoarse(absent, 1) == -1);
+
+	CHECK(micstasy_get_stats(f->bus, &stats, 0) == 1);
+	CHECK(stats.latency[MICSTASY_STAT_REQUEST].count == 3);
+	for(i=0; i<MICSTASY_STATS_BUCKETS; i++)
+		buckets += stats.latency[MICSTASY_STAT_REQUEST].buckets[i];
+	CHECK(buckets == 3);
+	CHECK(stats.latency[MICSTASY_STAT_REQUEST].maxUs*3 >= stats.latency[MICSTASY_STAT_REQUEST].totalUs);
+	CHECK(micstasy_stats_percentile(&stats.latency[MICSTASY_STAT_REQUEST], 99) > 0);
+	CHECK(stats.latency[MICSTASY_STAT_SET].count == 1);
+	CHECK(stats.timeouts == 2);	/* one per attempt */
+	CHECK(stats.retries == 1);
+	CHECK(stats.messagesSent == 3+1+2);
+	CHECK(stats.messagesReceived == 3);
+	CHECK(stats.bytesSent > 0 && stats.bytesReceived > 0);
+
+	/* reset returns the counters and clears them */
+	CHECK(micstasy_get_stats(f->bus, &stats, 1) == 1);
+	CHECK(stats.messagesSent == 3+1+2);
+	CHECK(micstasy_get_stats(f->bus, &stats, 0) == 1);
+	CHECK(stats.messagesSent == 0);
+	CHECK(stats.latency[MICSTASY_STAT_REQUEST].count == 0);
+
+	return 0;
+}
+
+
+static int test_restore_delta(struct fixture *f)
+{
+	int written;
+
+	CHECK(micstasy_set_gainCoarse(f->unit[0], 3, 25) == 1);
+	CHECK(micstasy_store_state(f->unit[0], TEST_STATE_FILE) == 1);
+
+	/* nothing changed: nothing to write */
+	written = micstasy_restore_state_delta(f->unit[0], TEST_STATE_FILE, 1);
+	CHECK(written == 0);
+
+	micstasy_sim_set_register(f->sim, 0, 0, 6, 9+50);
+	micstasy_cache_invalidate(f->unit[0]);
+
+	written = micstasy_restore_state_delta(f->unit[0], TEST_STATE_FILE, 1);
+	CHECK(written == 1);
+	CHECK(micstasy_sim_get_register(f->sim, 0, 0, 6) == 9+25);
+
+	remove(TEST_STATE_FILE);
+
+	return 0;
+}
+
+
+static int test_scene_apply(struct fixture *f)
+{
+	struct micstasy_scene scene;
+	int i;
+
+	memset(&scene, 0, sizeof(scene));
+	strcpy(scene.name, "test");
+
+	for(i=0; i<2; i++) {
+		CHECK(micstasy_set_gainCoarse(f->unit[i], 4, 10+i) == 1);
+		CHECK(micstasy_scene_capture(f->unit[i], &scene) == 1);
+	}
+	CHECK(scene.unitCount == 2);
+
+	micstasy_sim_set_register(f->sim, 0, 0, 9, 9+60);
+	micstasy_sim_set_register(f->sim, 0, 1, 9, 9+60);
+
+	for(i=0; i<2; i++) {
+		CHECK(micstasy_scene_apply(f->unit[i], &scene, 0) == MICSTASY_SCENE_REGISTERS);
+		CHECK(micstasy_sim_get_register(f->sim, 0, i, 9) == 9+10+i);
+	}
+
+	return 0;
+}
+
+
+/* rewrites the scene file with its last byte cut off or its version byte changed */
+static int damage_scene_file(boolean truncate)
+{
+	unsigned char bytes[4096];
+	size_t length;
+	FILE *sceneFile;
+
+	sceneFile = fopen(TEST_SCENE_FILE, "rb");
+	if(sceneFile == NULL)
+		return -1;
+	length = fread(bytes, 1, sizeof(bytes), sceneFile);
+	fclose(sceneFile);
+
+	if(truncate)
+		length--;
+	else
+		bytes[4] = MICSTASY_SCENE_VERSION+1;
+
+	sceneFile = fopen(TEST_SCENE_FILE, "wb");
+	if(sceneFile == NULL)
+		return -1;
+	fwrite(bytes, 1, length, sceneFile);
+	fclose(sceneFile);
+
+	return 1;
+}
+
+static int test_scene_library(struct fixture *f)
+{
+	struct micstasy_sceneLibrary *library;
+	struct micstasy_scene scene;
+	const struct micstasy_scene *stored;
+	int i;
+
+	remove(TEST_SCENE_FILE);
+
+	for(i=0; i<2; i++) {
+		memset(&scene, 0, sizeof(scene));
+		sprintf(scene.name, "scene %d", i);
+		CHECK(micstasy_set_gainCoarse(f->unit[0], 1, 20+i) == 1);
+		CHECK(micstasy_scene_capture(f->unit[0], &scene) == 1);
+		CHECK(micstasy_scenes_save(TEST_SCENE_FILE, &scene) == i);
+	}
+
+	/* same name again replaces the record */
+	CHECK(micstasy_scenes_save(TEST_SCENE_FILE, &scene) == 1);
+
+	library = micstasy_scenes_open(TEST_SCENE_FILE);
+	CHECK(library != NULL);
+	CHECK(library->sceneCount == 2);
+	CHECK(micstasy_scenes_find(library, "scene 0") == 0);
+	CHECK(micstasy_scenes_find(library, "scene 2") == -1);
+	CHECK(micstasy_errorCode() == MICSTASY_ERROR_NOT_FOUND);
+	CHECK(micstasy_scenes_get(library, 2) == NULL);
+
+	stored = micstasy_scenes_get(library, 0);
+	CHECK(stored != NULL);
+	CHECK(micstasy_scene_apply(f->unit[0], stored, 1) == 1);
+	CHECK(micstasy_sim_get_register(f->sim, 0, 0, 0) == 9+20);
+	micstasy_scenes_close(library);
+
+	CHECK(damage_scene_file(1) == 1);
+	CHECK(micstasy_scenes_open(TEST_SCENE_FILE) == NULL);
+	CHECK(micstasy_errorCode() == MICSTASY_ERROR_FILE);
+
+	remove(TEST_SCENE_FILE);
+	CHECK(micstasy_scenes_save(TEST_SCENE_FILE, &scene) == 0);
+	CHECK(damage_scene_file(0) == 1);
+	CHECK(micstasy_scenes_open(TEST_SCENE_FILE) == NULL);
+	CHECK(micstasy_errorCode() == MICSTASY_ERROR_FILE);
+	CHECK(micstasy_scenes_save(TEST_SCENE_FILE, &scene) == -1);
+
+	remove(TEST_SCENE_FILE);
+
+	return 0;
+}
+
+
+static int test_group_set(struct fixture *f)
+{
+	struct micstasy_value value = { 0x1D, 0x05 };
+
+	/* unrelated bits differ, both units keep theirs */
+	micstasy_sim_set_register(f->sim, 0, 0, 2, 0x01);
+	micstasy_sim_set_register(f->sim, 0, 1, 2, 0x02);
+
+	CHECK(micstasy_group_set_p48(f->bus, 1, 1) == 1);
+	CHECK(micstasy_sim_get_register(f->sim, 0, 0, 2) == 0x41);
+	CHECK(micstasy_sim_get_register(f->sim, 0, 1, 2) == 0x42);
+
+	CHECK(micstasy_group_set_gainCoarse(f->bus, 8, 33) == 1);
+	CHECK(micstasy_sim_get_register(f->sim, 0, 0, 21) == 9+33);
+	CHECK(micstasy_sim_get_register(f->sim, 0, 1, 21) == 9+33);
+
+	CHECK(micstasy_group_set_values(f->bus, &value, 1) == -1);
+
+	return 0;
+}
+
+
+static void meter_count(struct micstasy *cMicstasy, const struct micstasy_meterFrame *frame, void *userData)
+{
+	(void)cMicstasy;
+	(void)frame;
+	(*(int *)userData)++;
+}
+
+static int test_meter_stream(struct fixture *f)
+{
+	struct micstasy_meterFrame frames[16];
+	struct micstasy *extra;
+	int calls = 0, i;
+
+	CHECK(micstasy_meter_stream_start(f->unit[0], 200, meter_count, &calls) == 1);
+
+	/* a unit closed while another one keeps streaming */
+	for(i=0; i<20; i++) {
+		extra = micstasy_bus_unit(f->bus, 0, 1);
+		CHECK(extra != NULL);
+		CHECK(micstasy_meter_stream_start(extra, 1000, NULL, NULL) == 1);
+		Sleep(2);
+		CHECK(micstasy_close(extra) == 1);
+	}
+
+	CHECK(micstasy_meter_stream_stop(f->unit[0]) == 1);
+	CHECK(calls > 0);
+	CHECK(micstasy_meter_stream_read(f->unit[0], frames, 16) > 0);
+
+	i = calls;
+	Sleep(20);
+	CHECK(calls == i);
+
+	return 0;
+}
+
+
+static int test_async(struct fixture *f)
+{
+	struct micstasy_completion completion;
+	int token;
+
+	micstasy_sim_set_register(f->sim, 0, 1, 12, 9+7);
+	micstasy_sim_set_register(f->sim, 0, 1, 13, 0x00);
+	micstasy_cache_invalidate(f->unit[1]);
+
+	token = micstasy_async_get_gain(f->unit[1], 5, NULL, NULL);
+	CHECK(token > 0);
+
+	CHECK(micstasy_async_wait(f->bus, &completion, 1000) == 1);
+	CHECK(completion.token == token);
+	CHECK(completion.status == 1);
+	CHECK(completion.value.gain == 7);
+
+	return 0;
+}
+
+
+static int test_trace_replay(struct fixture *f)
+{
+	struct micstasy_replayResult result;
+	struct micstasy_trace *trace;
+	struct micstasy_state state;
+
+	CHECK(micstasy_trace_start(f->bus, TEST_TRACE_FILE) == 1);
+	CHECK(micstasy_get_state(f->unit[0], &state) == 1);
+	CHECK(micstasy_set_gainCoarse(f->unit[0], 2, 15) == 1);
+	CHECK(micstasy_get_state(f->unit[1], &state) == 1);
+	CHECK(micstasy_trace_stop(f->bus) == 1);
+
+	trace = micstasy_trace_load(TEST_TRACE_FILE);
+	CHECK(trace != NULL);
+	CHECK(trace->recordCount >= 5);
+	micstasy_trace_free(trace);
+
+	CHECK(micstasy_replay(TEST_TRACE_FILE, 0, 1000, &result) == 1);
+	CHECK(result.messagesSent == 3);
+	CHECK(result.repliesTaken == 2);
+	CHECK(result.repliesMissed == 0);
+	CHECK(result.mismatches == 0);
+
+	remove(TEST_TRACE_FILE);
+
+	return 0;
+}
+
+
+static int test_schedule_ramp(struct fixture *f)
+{
+	struct micstasy_value value = { 0x0C, 9+44 };
+	int i;
+
+	CHECK(micstasy_schedule_values(f->unit[0], micstasy_clock_us() + 5000, &value, 1) > 0);
+	CHECK(micstasy_sim_get_register(f->sim, 0, 0, 0x0C) == 9);
+	Sleep(50);
+	CHECK(micstasy_sim_get_register(f->sim, 0, 0, 0x0C) == 9+44);
+
+	CHECK(micstasy_ramp_gain(f->unit[1], 6, 30.5, 20, MICSTASY_RAMP_SCURVE) == 1);
+	CHECK(micstasy_ramp_active(f->unit[1], 6) == 1);
+
+	for(i=0; i<100 && micstasy_ramp_active(f->unit[1], 6); i++)
+		Sleep(5);
+
+	CHECK(micstasy_ramp_active(f->unit[1], 6) == 0);
+	CHECK(micstasy_sim_get_register(f->sim, 0, 1, 0x0F) == 9+30);
+	CHECK((micstasy_sim_get_register(f->sim, 0, 1, 0x10) & 0x01) == 1);
+	CHECK(micstasy_ramp_stop(f->unit[1], 6) == -1);
+
+	return 0;
+}
+
+
+struct test {
+	const char *name;
+	int (*run)(struct fixture *f);
+};
+
+static const struct test tests[] = {
+	{ "get_state", test_get_state },
+	{ "cache", test_cache },
+	{ "set_values", test_set_values },
+	{ "pipeline", test_pipeline },
+	{ "receiver", test_receiver },
+	{ "loopback", test_loopback },
+	{ "stats", test_stats },
+	{ "restore_delta", test_restore_delta },
+	{ "scene_apply", test_scene_apply },
+	{ "scene_library", test_scene_library },
+	{ "group_set", test_group_set },
+	{ "meter_stream", test_meter_stream },
+	{ "async", test_async },
+	{ "trace_replay", test_trace_replay },
+	{ "schedule_ramp", test_schedule_ramp },
+	{ NULL, NULL }
+};
+
+
+int main(void)
+{
+	struct fixture f;
+	int i, ret, failed = 0;
+
+	for(i=0; tests[i].name != NULL; i++)
+	{
+		if(fixture_open(&f) == -1) {
+			fprintf(stderr, "%s: unable to open the simulator\n", tests[i].name);
+			return 1;
+		}
+
+		ret = tests[i].run(&f);
+		failed += ret;
+		printf("%s: %s\n", tests[i].name, ret ? "FAILED" : "ok");
+
+		fixture_close(&f);
+	}
+
+	return failed;
+}
@@ -13,6 +13,17 @@
 #include <string.h>
 #include <time.h>
 
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+#ifdef MICSTASY_HAVE_ALSA
+	#include <alsa/asoundlib.h>
+	#include <poll.h>
+#endif
+
 #include "micstasyc.h"
 
 
@@ -20,9 +31,174 @@
 #define DEBUG 0
 
 #define BIT(X) (1<<X)
+
+#define INPUT_POLL_INTERVAL_US 1000
+#define RECEIVER_WAKEUP_US 100000	/* how often an idle receiver thread checks for shutdown */
+#define SCHEDULE_SPIN_US 2000		/* the scheduler sleeps until this close to an item, */
+#define SCHEDULE_POLL_US 100		/* then checks the clock this often */
+#define RAMP_TICK_US 1000		/* gain ramps are updated at most this often */
+#define MIDI_BYTE_US 320		/* 10 bits at 31250 baud */
+#define RAMP_PI 3.14159265358979
 int levelMeterLookupTable[] = { -70, -60, -50, -42, -36, -30, -24, -18, -12, -6, -3, -1, -0.1, 0 };
 
-static char *errorMessage = NULL;
+/* last error of the calling thread */
+#ifdef _MSC_VER
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
+static THREAD_LOCAL int errorCode = MICSTASY_OK;
+static THREAD_LOCAL const char *errorMessage = NULL;
+
+
+/* monotonic clock in microseconds */
+static uint64_t clock_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, frequency;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+
+	return (uint64_t)(count.QuadPart / frequency.QuadPart) * 1000000
+		+ (uint64_t)(count.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+uint64_t micstasy_clock_us(void)
+{
+	return clock_us();
+}
+
+
+static int error(int code, const char *err_msg);
+
+
+/* minimal threading layer (Win32 / pthreads) */
+#ifdef _WIN32
+	#define THREAD_FUNCTION(name) DWORD WINAPI name(LPVOID arg)
+	#define THREAD_RETURN 0
+	#define memory_barrier() MemoryBarrier()
+#else
+	#define THREAD_FUNCTION(name) void *name(void *arg)
+	#define THREAD_RETURN NULL
+	#define memory_barrier() __sync_synchronize()
+#endif
+
+static void mutex_init(micstasy_mutex *mutex)
+{
+#ifdef _WIN32
+	InitializeCriticalSection(mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+static void mutex_destroy(micstasy_mutex *mutex)
+{
+#ifdef _WIN32
+	DeleteCriticalSection(mutex);
+#else
+	pthread_mutex_destroy(mutex);
+#endif
+}
+
+static void mutex_lock(micstasy_mutex *mutex)
+{
+#ifdef _WIN32
+	EnterCriticalSection(mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif
+}
+
+static void mutex_unlock(micstasy_mutex *mutex)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif
+}
+
+static void cond_init(micstasy_cond *cond)
+{
+#ifdef _WIN32
+	InitializeConditionVariable(cond);
+#else
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+#endif
+}
+
+static void cond_destroy(micstasy_cond *cond)
+{
+#ifdef _WIN32
+	(void)cond;
+#else
+	pthread_cond_destroy(cond);
+#endif
+}
+
+static void cond_broadcast(micstasy_cond *cond)
+{
+#ifdef _WIN32
+	WakeAllConditionVariable(cond);
+#else
+	pthread_cond_broadcast(cond);
+#endif
+}
+
+/* waits until signalled or until the monotonic deadline (clock_us) has passed */
+static void cond_wait_until(micstasy_cond *cond, micstasy_mutex *mutex, uint64_t deadline)
+{
+	uint64_t now = clock_us();
+
+	if(now >= deadline)
+		return;
+#ifdef _WIN32
+	SleepConditionVariableCS(cond, mutex, (DWORD)((deadline-now+999)/1000));
+#else
+	{
+		struct timespec ts;
+		ts.tv_sec = deadline / 1000000;
+		ts.tv_nsec = (deadline % 1000000) * 1000;
+		pthread_cond_timedwait(cond, mutex, &ts);
+	}
+#endif
+}
+
+static int thread_create(micstasy_thread *thread, THREAD_FUNCTION((*function)), void *arg)
+{
+#ifdef _WIN32
+	*thread = CreateThread(NULL, 0, function, arg, 0, NULL);
+	return *thread != NULL ? 1 : -1;
+#else
+	return pthread_create(thread, NULL, function, arg) == 0 ? 1 : -1;
+#endif
+}
+
+static void thread_join(micstasy_thread thread)
+{
+#ifdef _WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif
+}
+
 
 char *micstasy_list_midiDevices()
 {
@@ -65,7 +241,7 @@ char *micstasy_list_midiDevices()
 }	
 
 
-static void print_sysex(char *msg)
+static void print_sysex(const int8_t *msg)
 {
 	int i = 0;
 	printf("sysEx: ");
@@ -84,22 +260,88 @@ static void print_sysex(char *msg)
 
 
 
-static int sysex_message_send(struct micstasy *cMicstasy, int messageType, boolean sendParameterNumber, int8_t parameterNumber, boolean sendDataByte, int8_t dataByte)
+/* statistics, see micstasy_get_stats() */
+
+static void histogram_add(struct micstasy_histogram *histogram, uint64_t us)
 {
+	int bucket = 0;
 
-	int8_t msg[20];
-	int i=0;
-	PmError ret;
-	PmTimestamp when = 0;
-	PmEvent event;
-	PmError count;
+	while(bucket < MICSTASY_STATS_BUCKETS-1 && (us >> (bucket+1)) != 0)
+		bucket++;
+
+	histogram->count++;
+	histogram->totalUs += us;
+	if(us > histogram->maxUs)
+		histogram->maxUs = us;
+	histogram->buckets[bucket]++;
+}
+
+static void stats_latency(struct micstasy_bus *bus, int operation, uint64_t start)
+{
+	uint64_t us = clock_us() - start;
+
+	mutex_lock(&bus->statsLock);
+	histogram_add(&bus->stats.latency[operation], us);
+	mutex_unlock(&bus->statsLock);
+}
+
+/* adds n to one of the uint64_t counters of bus->stats */
+static void stats_count(struct micstasy_bus *bus, uint64_t *counter, uint64_t n)
+{
+	mutex_lock(&bus->statsLock);
+	*counter += n;
+	mutex_unlock(&bus->statsLock);
+}
+
+
+/* traffic traces, see micstasy_trace_start() */
+
+static void write_varint(FILE *file, uint64_t value)
+{
+	while(value >= 0x80) {
+		fputc((int)(value & 0x7F) | 0x80, file);
+		value >>= 7;
+	}
+	fputc((int)value, file);
+}
+
+/* records bytes crossing the transport if the bus is being traced */
+static void trace_record(struct micstasy_bus *bus, int direction, const unsigned char *bytes, int length)
+{
+	uint64_t now;
+
+	mutex_lock(&bus->traceLock);
+
+	if(bus->trace != NULL)
+	{
+		now = clock_us();
 
-	/* before sending anything clear input buffer */
-	do {
-		count = Pm_Read(cMicstasy->portMidiStreamIn, &event, 1);
+		fputc(direction, bus->trace);
+		write_varint(bus->trace, now - bus->traceTime);
+		write_varint(bus->trace, length);
+		fwrite(bytes, 1, length, bus->trace);
+
+		/* a stalled or crashed session is what we want to look at */
+		fflush(bus->trace);
+
+		bus->traceTime = now;
 	}
-	while(count != 0);
-	Sleep(1);
+
+	mutex_unlock(&bus->traceLock);
+}
+
+
+/* writes one sysex message to the unit at address, without touching the input */
+static int sysex_write(struct micstasy_bus *bus, int8_t address, int messageType, const int8_t *data, int dataLength)
+{
+
+	int8_t msg[MICSTASY_MAX_SYSEX_LENGTH];
+	int i=0;
+	int ret;
+	uint64_t start;
+
+	if(dataLength > MICSTASY_MAX_SYSEX_LENGTH-8)
+		return error(MICSTASY_ERROR_ARGUMENT, "Error: sysex message too long");
 
 	msg[i++] = SYS_EX_HEADER;
 	msg[i++] = MIDI_TEMP_MANUFACTRURER_ID_1;
@@ -107,14 +349,12 @@ static int sysex_message_send(struct micstasy *cMicstasy, int messageType, boole
 	msg[i++] = MIDI_TEMP_MANUFACTRURER_ID_3;
 	msg[i++] = MODEL_ID;
 
-	msg[i++] = (cMicstasy->bankNumber<<4) | cMicstasy->deviceID;
+	msg[i++] = address;
 	msg[i++] = messageType;
 
-
-	if(sendParameterNumber) msg[i++] = parameterNumber;
-	if(sendDataByte) msg[i++] = dataByte;
-
-
+	if(dataLength > 0)
+		memcpy(msg+i, data, dataLength);
+	i += dataLength;
 
 	msg[i++] = EOX;
 
@@ -125,862 +365,4518 @@ static int sysex_message_send(struct micstasy *cMicstasy, int messageType, boole
 		print_sysex(msg);
 	}
 
-	ret = Pm_WriteSysEx(cMicstasy->portMidiStreamOut, when, msg);
+	start = clock_us();
+
+	mutex_lock(&bus->sendLock);
+	trace_record(bus, MICSTASY_TRACE_OUT, (unsigned char *)msg, i);
+	ret = bus->transport->write_sysex(bus->port, (unsigned char *)msg);
+	mutex_unlock(&bus->sendLock);
+
+	if(ret != 1)
+		return error(MICSTASY_ERROR_MIDI, Pm_GetErrorText((PmError)ret));
 
+	mutex_lock(&bus->statsLock);
+	bus->stats.messagesSent++;
+	bus->stats.bytesSent += i;
+	if(messageType == MESSAGETYPE_SET_VALUE)
+		histogram_add(&bus->stats.latency[MICSTASY_STAT_SET], clock_us() - start);
+	mutex_unlock(&bus->statsLock);
 
 	return 1;
 }
 
 
-char *micstasy_errorMessage(void)
+static void meter_thread_stop(struct micstasy_bus *bus);
+static void async_thread_stop(struct micstasy_bus *bus);
+static void async_forget_unit(struct micstasy *cMicstasy);
+static void scheduler_thread_stop(struct micstasy_bus *bus);
+static void schedule_forget_unit(struct micstasy *cMicstasy);
+
+
+/* sets expect no reply, so they go straight out */
+static int sysex_message_send_data(struct micstasy *cMicstasy, int messageType, const int8_t *data, int dataLength)
 {
-	return errorMessage;
+	return sysex_write(cMicstasy->bus, (cMicstasy->bankNumber<<4) | cMicstasy->deviceID, messageType, data, dataLength);
 }
 
 
-static int error(char *err_msg)
+/* keeps the char * of the old API, the text must not be modified */
+char *micstasy_errorMessage(void)
 {
-    if(errorMessage != NULL)
-        free(errorMessage);
-    
-    errorMessage = strdup(err_msg);
-    
-    if(DEBUG) printf("%s", err_msg);
-
-	return -1;
+	return (char *)(errorMessage != NULL ? errorMessage : micstasy_errorString(errorCode));
 }
 
 
+int micstasy_errorCode(void)
+{
+	return errorCode;
+}
+
 
-int8_t *getSysExFromEventBuffer(CircularBuffer *readBuffer, int *length)
+const char *micstasy_errorString(int code)
 {
-	int8_t *output = (char *)malloc(readBuffer->size*4);
-	int i=0;
-	int shift;
-	int8_t data;
-	PmEvent event;
+	switch(code)
+	{
+		case MICSTASY_OK:			return "no error";
+		case MICSTASY_ERROR_ARGUMENT:	return "argument out of range";
+		case MICSTASY_ERROR_TIMEOUT:	return "no response from micstasy";
+		case MICSTASY_ERROR_RESPONSE:	return "unexpected response from micstasy";
+		case MICSTASY_ERROR_MIDI:		return "MIDI error";
+		case MICSTASY_ERROR_FILE:		return "file error";
+		case MICSTASY_ERROR_STATE:		return "operation not possible in this state";
+		case MICSTASY_ERROR_NOT_FOUND:	return "not found";
+		case MICSTASY_ERROR_SYSTEM:		return "system error";
+	}
 
-	*length = 0;
+	return "unknown error";
+}
 
-	while(!cbIsEmpty(readBuffer))
-	{	
 
-		cbRead(readBuffer, &event);
+/* err_msg must be a static string, it is kept by reference */
+static int error(int code, const char *err_msg)
+{
+	errorCode = code;
+	errorMessage = err_msg;
 
-	        if (is_real_time_msg(Pm_MessageStatus(event.message))) continue;
+	if(DEBUG) printf("%s", err_msg);
 
+	return -1;
+}
 
-		for (shift = 0; shift < 32; shift += 8)
-		{
-			data = (event.message >> shift) & 0xFF;
 
-			if(data == SYS_EX_HEADER)
-			{
 
-				output[0] = data;
-				i=1;
-			}
-			else if(i>0)
-			{
+/* feeds one byte into the parser; returns 1 once parser->data holds a
+   complete message of parser->length bytes, -1 when an unfinished one was
+   dropped, 0 otherwise */
+static int sysex_parse_byte(struct micstasy_sysexParser *parser, int8_t data)
+{
+	int dropped = parser->length > 0 ? -1 : 0;
 
+	if(data == SYS_EX_HEADER)
+	{
+		parser->data[0] = data;
+		parser->length = 1;
+		parser->overflow = 0;
+		return dropped;
+	}
 
-				/* if this is a status byte that's not MIDI_EOX, the sysex
-				message is incomplete and there is no more sysex data */
-				if(data & 0x80 && data != EOX)
-				{
-					i=0;
-					break;
-				}
+	if(parser->length == 0)
+		return 0;
 
-				output[i] = data;
-				i++;
+	/* a status byte other than EOX ends the message early, drop it */
+	if(data & 0x80 && data != EOX)
+	{
+		parser->length = 0;
+		return -1;
+	}
 
-				if(data == EOX)
-				{
-					*length = i;
-					return output;
-				}
-			}
-		}
+	if(parser->length == MICSTASY_MAX_SYSEX_LENGTH)
+		parser->overflow = 1;
+	else
+		parser->data[parser->length++] = data;
 
-		
+	if(data != EOX)
+		return 0;
+
+	if(parser->overflow) {
+		if(DEBUG) printf("WARNING: sysex message too long, dropped\n");
+		parser->length = 0;
+		return -1;
 	}
 
-	free(output);
+	return 1;
+}
+
 
-	return NULL;
+
+/* PortMidi time proc: stamps input events on our monotonic clock in ms, so
+   replies can be told apart from requests sent before they arrived */
+static PmTimestamp bus_time(void *info)
+{
+	(void)info;
+
+	return (PmTimestamp)(clock_us()/1000);
 }
 
+/* wrap-safe a < b for PmTimestamps */
+#define TIME_BEFORE(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
 
 
-static int8_t *sysex_message_receive(struct micstasy *cMicstasy, int messageType, int *length)
+static void sleep_us(uint64_t us)
 {
-	PmEvent msg;
-	int cnt;
-	time_t timeout = time(NULL)+4;
-	int8_t *data = NULL;
+#ifdef _WIN32
+	Sleep((DWORD)((us+999)/1000));
+#else
+	usleep((useconds_t)us);
+#endif
+}
 
-	if(DEBUG) printf("reading\n");
 
-	do
-	{
+/* transports, see struct micstasy_transport */
 
-		do {
-			cnt = Pm_Read(cMicstasy->portMidiStreamIn, &msg, 1);
-			if (cnt != 0)
-			{
-				if(cbIsFull(&cMicstasy->readBuffer) && DEBUG) printf("WARNING: readBuffer overflow\n");
-				cbWrite(&cMicstasy->readBuffer, &msg); 
-			}
-		} while(cnt != 0);
+/* PortMidi: events are read into a ring and unpacked into sysex bytes */
+struct pm_port {
+	PortMidiStream *in;
+	PortMidiStream *out;
+	CircularBuffer events;
+	PmEvent event;		/* being unpacked */
+	int eventBytes;		/* bytes of event not unpacked yet */
+};
+
+static int pm_write_sysex(void *port, const unsigned char *msg)
+{
+	PmError ret = Pm_WriteSysEx(((struct pm_port *)port)->out, 0, (unsigned char *)msg);
 
+	return ret == pmNoError ? 1 : ret;
+}
+
+static int pm_read_events(void *source, PmEvent *buffer, int length)
+{
+	return Pm_Read(((struct pm_port *)source)->in, buffer, length);
+}
 
-		data = getSysExFromEventBuffer(&cMicstasy->readBuffer, length);
+static int pm_read(void *port, unsigned char *buffer, int length, PmTimestamp *timestamp)
+{
+	struct pm_port *pm = (struct pm_port *)port;
+	unsigned char byte;
+	int count = 0;
 
-		if(*length > 0)
+	while(count < length)
+	{
+		if(pm->eventBytes == 0)
 		{
-			if(DEBUG) printf("got SysEX data of lenght: %d\n", *length);
+			if(cbIsEmpty(&pm->events) && cbFill(&pm->events, pm_read_events, pm) == 0)
+				break;
 
+			cbRead(&pm->events, &pm->event);
+			if(is_real_time_msg(Pm_MessageStatus(pm->event.message))) continue;
+			pm->eventBytes = 4;
+		}
 
-			if(*length > 6)
-			{
-				print_sysex(data);
+		/* sysex comes four bytes per event, least significant first */
+		byte = (pm->event.message >> (8*(4-pm->eventBytes))) & 0xFF;
+		pm->eventBytes--;
 
-				if(data[6] == messageType)
-					return data;
-			}
-			
-			
-			free(data);
+		buffer[count++] = byte;
+		*timestamp = pm->event.timestamp;
+
+		if(byte == 0xF7) {
+			pm->eventBytes = 0;	/* the rest only pads the event */
+			break;
 		}
-		else Sleep(1);
 	}
-	while(timeout > time(NULL));
 
+	return count;
+}
+
+static int pm_poll(void *port)
+{
+	struct pm_port *pm = (struct pm_port *)port;
 
+	return pm->eventBytes > 0 || !cbIsEmpty(&pm->events) || Pm_Poll(pm->in) == pmGotData;
+}
 
-	*length = 0;
+static uint32_t pm_overflows(void *port)
+{
+	return ((struct pm_port *)port)->events.overflows;
+}
 
+static int pm_close(void *port)
+{
+	struct pm_port *pm = (struct pm_port *)port;
 
-	error("no response from micstasy");
+	Pm_Close(pm->in);
+	Pm_Close(pm->out);
+	cbFree(&pm->events);
+	free(pm);
 
-	return NULL;
+	return 1;
 }
 
+static const struct micstasy_transport pm_transport = {
+	"portmidi",
+	pm_write_sysex,
+	pm_read,
+	pm_poll,
+	NULL,
+	NULL,
+	pm_overflows,
+	pm_close
+};
 
 
-struct micstasy *micstasy_init(int midiDeviceIn, int midiDeviceOut, int bankNumber, int deviceID)
+/* loopback: a byte queue in memory */
+static void loopback_put(struct micstasy_loopback *loopback, const unsigned char *bytes, int length)
 {
-	struct micstasy *nMicstasy;
-	PmError ret;
-	PortMidiStream *stream;
-	long bufferSize = 100;
-
-	nMicstasy = (struct micstasy *) malloc(sizeof(struct micstasy));
+	PmTimestamp now = bus_time(NULL);
+	int i;
 
-	nMicstasy->bankNumber = bankNumber;
-	nMicstasy->deviceID = deviceID;
-	cbInit(&nMicstasy->readBuffer, BUF_SIZE);
+	mutex_lock(&loopback->lock);
 
-	if(DEBUG) printf("connecting to micstasy\n");
+	for(i=0; i<length; i++)
+	{
+		if(loopback->head - loopback->tail == MICSTASY_LOOPBACK_SIZE) {
+			loopback->overflows++;
+			continue;
+		}
 
+		loopback->time[loopback->head & (MICSTASY_LOOPBACK_SIZE-1)] = now;
+		loopback->data[loopback->head & (MICSTASY_LOOPBACK_SIZE-1)] = bytes[i];
+		loopback->head++;
+	}
 
+	mutex_unlock(&loopback->lock);
+}
 
+static int loopback_write_sysex(void *port, const unsigned char *msg)
+{
+	struct micstasy_loopback *loopback = (struct micstasy_loopback *)port;
+	int length;
 
-	if(DEBUG) printf("opening output device %d\n", midiDeviceOut);
-	ret = Pm_OpenOutput(&stream,
-		         midiDeviceOut,
-		         NULL,
-		         bufferSize,
-		         NULL,
-		         NULL,
-		         0);
+	for(length=0; length < MICSTASY_MAX_SYSEX_LENGTH && msg[length] != 0xF7; length++);
+	if(length == MICSTASY_MAX_SYSEX_LENGTH)
+		return pmBadData;
 
-	if(DEBUG) printf("Returned %d\n", ret);
-	if(ret != pmNoError) {
-		error((char *)Pm_GetErrorText(ret));
-		free(nMicstasy);
-		return NULL;
-	}
+	if(loopback->echo)
+		loopback_put(loopback, msg, length+1);
 
-	nMicstasy->portMidiStreamOut = stream;
+	return 1;
+}
 
+static int loopback_read(void *port, unsigned char *buffer, int length, PmTimestamp *timestamp)
+{
+	struct micstasy_loopback *loopback = (struct micstasy_loopback *)port;
+	uint32_t index;
+	int count = 0;
 
-	if(DEBUG) printf("opening input device %d\n", midiDeviceIn);
-	ret = Pm_OpenInput(&stream,
-		         midiDeviceIn,
-		         NULL,
-		         bufferSize,
-		         NULL,
-		         NULL
-		         );
+	mutex_lock(&loopback->lock);
 
+	while(count < length && loopback->tail != loopback->head)
+	{
+		index = loopback->tail++ & (MICSTASY_LOOPBACK_SIZE-1);
+		buffer[count++] = loopback->data[index];
+		*timestamp = loopback->time[index];
 
-	if(DEBUG) printf("returned: %d\n", ret);
-	if(ret != pmNoError) {
-		error((char *)Pm_GetErrorText(ret));
-		free(nMicstasy);
-		return NULL;
+		if(loopback->data[index] == 0xF7)
+			break;
 	}
 
-	nMicstasy->portMidiStreamIn = stream;
+	mutex_unlock(&loopback->lock);
 
-	return nMicstasy;
+	return count;
 }
 
+static int loopback_poll(void *port)
+{
+	struct micstasy_loopback *loopback = (struct micstasy_loopback *)port;
+	int ready;
 
-int8_t micstasy_request_value(struct micstasy *cMicstasy, char parameterNumber)
+	mutex_lock(&loopback->lock);
+	ready = loopback->tail != loopback->head;
+	mutex_unlock(&loopback->lock);
+
+	return ready;
+}
+
+static uint32_t loopback_overflows(void *port)
 {
-	char dataByte=-1;
-	char *response;
-	int8_t value;
-	int length=0;
+	struct micstasy_loopback *loopback = (struct micstasy_loopback *)port;
+	uint32_t overflows;
 
+	mutex_lock(&loopback->lock);
+	overflows = loopback->overflows;
+	mutex_unlock(&loopback->lock);
 
-	sysex_message_send( cMicstasy, MESSAGETYPE_REQUEST_VALUE, 0, parameterNumber, 0, dataByte);
+	return overflows;
+}
 
-	response = sysex_message_receive(cMicstasy, MESSAGETYPE_RESPONSE_VALUE, &length);
+static int loopback_close(void *port)
+{
+	struct micstasy_loopback *loopback = (struct micstasy_loopback *)port;
 
+	mutex_destroy(&loopback->lock);
+	free(loopback);
 
-	if(length > 8+parameterNumber*2)
-		value = response[8+parameterNumber*2];
-	else
-		value = -1; /* no error -> MSB: 0 */
+	return 1;
+}
 
+static const struct micstasy_transport loopback_transport = {
+	"loopback",
+	loopback_write_sysex,
+	loopback_read,
+	loopback_poll,
+	NULL,
+	NULL,
+	loopback_overflows,
+	loopback_close
+};
+
+
+#ifdef MICSTASY_HAVE_ALSA
+
+/* ALSA rawmidi: plain bytes, no event packing; the input can be polled */
+struct rawmidi_port {
+	snd_rawmidi_t *in;
+	snd_rawmidi_t *out;
+	struct pollfd pollfd;
+	uint32_t overflows;
+	unsigned char pending[MICSTASY_TRANSPORT_CHUNK];	/* read but not handed out yet */
+	int pendingStart, pendingEnd;
+	PmTimestamp pendingTime;
+};
+
+static int rawmidi_write_sysex(void *port, const unsigned char *msg)
+{
+	struct rawmidi_port *rawmidi = (struct rawmidi_port *)port;
+	int length;
 
-	free(response);
+	for(length=0; length < MICSTASY_MAX_SYSEX_LENGTH && msg[length] != 0xF7; length++);
+	if(length == MICSTASY_MAX_SYSEX_LENGTH)
+		return pmBadData;
+	length++;
 
+	if(snd_rawmidi_write(rawmidi->out, msg, length) != length)
+		return pmHostError;
 
-	return value;
+	return 1;
 }
 
-
-int micstasy_get_levelMeterData(struct micstasy *cMicstasy, struct micstasy_levelMeterData *levelMeterData)
+/* rawmidi has no arrival times, bytes are dated when read */
+static int rawmidi_read(void *port, unsigned char *buffer, int length, PmTimestamp *timestamp)
 {
-	char *response;
-	int length;
-	int i;
+	struct rawmidi_port *rawmidi = (struct rawmidi_port *)port;
+	ssize_t n;
+	int count = 0;
 
-	sysex_message_send( cMicstasy, MESSAGETYPE_REQUEST_LEVELMETER_DATA, 0, 0, 0, 0);
+	if(rawmidi->pendingStart == rawmidi->pendingEnd)
+	{
+		n = snd_rawmidi_read(rawmidi->in, rawmidi->pending, sizeof(rawmidi->pending));
+		if(n == -EAGAIN)
+			return 0;
+		if(n < 0)
+			return -1;
+
+		rawmidi->pendingStart = 0;
+		rawmidi->pendingEnd = (int)n;
+		rawmidi->pendingTime = bus_time(NULL);
+	}
 
-	response = sysex_message_receive(cMicstasy, MESSAGETYPE_RESPONSE_LEVELMETER_DATA, &length);
-	/* F0 00 20 0D 68 (bank no. / dev ID) 31 (ch.1) (ch.2) (ch.3) (ch.4) (ch.5) (ch.6) (ch.7) (ch.8) F7 */
+	while(count < length && rawmidi->pendingStart < rawmidi->pendingEnd)
+	{
+		buffer[count] = rawmidi->pending[rawmidi->pendingStart++];
+		if(buffer[count++] == 0xF7)
+			break;
+	}
 
-	if(length > 15)
-		for(i=0; i<8; i++)
-			if(response[7+i] >= 0 && response[7+i] < 14)
-				levelMeterData->channel[i] = levelMeterLookupTable[response[7+i]];
-			else levelMeterData->channel[i] = 0;
-	else
-		for(i=0; i<8; i++)
-			levelMeterData->channel[i] = 0;
+	*timestamp = rawmidi->pendingTime;
 
-	free(response);
+	return count;
+}
 
+static int rawmidi_wait(void *port, uint64_t deadline)
+{
+	struct rawmidi_port *rawmidi = (struct rawmidi_port *)port;
+	uint64_t now;
 
+	while(rawmidi->pendingStart == rawmidi->pendingEnd)
+	{
+		now = clock_us();
+		if(now >= deadline)
+			return 0;
 
-	/*
-	Request Level Meter Data 
+		rawmidi->pollfd.revents = 0;
+		if(poll(&rawmidi->pollfd, 1, (int)((deadline-now+999)/1000)) > 0)
+			return 1;
+	}
 
-		MSB / 7		0
-		6		0
-		5		0
-		4		0
-		3 		MSB / 3 	2
-		1		LSB / 0 	/ 2/ 1
-		0		LSB / 0 	0
-		0
-	
-		Level: 0 	= < -70dBFS peak
-		Level: 1..12 	= < -60 / -50 / -42 / -36 / -30 / -24 /-18 / -12 / -6 / -3 / -1 / -0.1 dBFS
-		Level: 13 	= > -0.1 dBFS (over)
-	*/
+	return 1;
+}
 
-	return levelMeterData->channel[0];
+static int rawmidi_poll(void *port)
+{
+	struct rawmidi_port *rawmidi = (struct rawmidi_port *)port;
+
+	if(rawmidi->pendingStart < rawmidi->pendingEnd)
+		return 1;
+
+	rawmidi->pollfd.revents = 0;
+	return poll(&rawmidi->pollfd, 1, 0) > 0;
+}
+
+static int rawmidi_fd(void *port)
+{
+	return ((struct rawmidi_port *)port)->pollfd.fd;
 }
 
+/* the driver counts xruns since the last status query */
+static uint32_t rawmidi_overflows(void *port)
+{
+	struct rawmidi_port *rawmidi = (struct rawmidi_port *)port;
+	snd_rawmidi_status_t *status;
 
+	snd_rawmidi_status_alloca(&status);
+	if(snd_rawmidi_status(rawmidi->in, status) == 0)
+		rawmidi->overflows += snd_rawmidi_status_get_xruns(status);
 
-int micstasy_set_value(struct micstasy *cMicstasy, char parameterNumber, char dataByte)
+	return rawmidi->overflows;
+}
+
+static int rawmidi_close(void *port)
 {
-	int ret;
+	struct rawmidi_port *rawmidi = (struct rawmidi_port *)port;
 
-	ret = sysex_message_send(cMicstasy, MESSAGETYPE_SET_VALUE, 1, parameterNumber, 1, dataByte);
+	snd_rawmidi_close(rawmidi->in);
+	snd_rawmidi_close(rawmidi->out);
+	free(rawmidi);
 
-	return ret;
+	return 1;
 }
 
+static const struct micstasy_transport rawmidi_transport = {
+	"rawmidi",
+	rawmidi_write_sysex,
+	rawmidi_read,
+	rawmidi_poll,
+	rawmidi_wait,
+	rawmidi_fd,
+	rawmidi_overflows,
+	rawmidi_close
+};
 
+#endif
 
-int micstasy_set_gainCoarse(struct micstasy *cMicstasy, int channel, int dbValue)
+
+/* transports without a waitable input (PortMidi has no handle for its
+   queue) are polled against a monotonic deadline, and only read once data
+   is pending. Returns 1 if input is available, 0 on timeout */
+static int wait_for_input(struct micstasy_bus *bus, uint64_t deadline)
 {
-	char value, ret;
-	int parameterNumber;
+	uint64_t now;
 
-	if(channel < 1 || channel > 8){
-		error("Error: channel out of range (1..8)");
-		return -1;
-	}
-	
-	if(dbValue < -9 || dbValue > 76){
-		error("Error: dB Value out of range (-9..76 dB)");
-		return -1;
+	if(bus->transport->wait != NULL)
+		return bus->transport->wait(bus->port, deadline);
+
+	while(!bus->transport->poll(bus->port))
+	{
+		now = clock_us();
+		if(now >= deadline)
+			return 0;
+
+		sleep_us(deadline-now < INPUT_POLL_INTERVAL_US ? deadline-now : INPUT_POLL_INTERVAL_US);
 	}
 
-	value = dbValue+9;
-	parameterNumber = (channel-1)*3;
+	return 1;
+}
 
 
-	ret = micstasy_set_value(cMicstasy, parameterNumber, value);
+/* the inbox holds every reply read from the bus until a waiter takes it;
+   all inbox functions are called with bus->lock held */
 
+/* returns 1 to take the message, 0 to leave it, REPLY_STALE to drop it */
+typedef int (*reply_match)(const struct micstasy_sysex *message, void *context);
 
-	return ret;
-}
+#define REPLY_STALE -1
 
-int micstasy_get_gainCoarse(struct micstasy *cMicstasy, int channel)
+struct reply_filter {
+	int8_t address;		/* ADDRESS_BROADCAST: any unit */
+	int8_t messageType;	/* 0: any response */
+	PmTimestamp since;	/* replies received before are stale */
+};
+
+
+static int reply_filter_match(const struct micstasy_sysex *message, void *context)
 {
+	struct reply_filter *filter = (struct reply_filter *)context;
 
-	int dbValue;
-	int parameterNumber;
+	if(filter->messageType != 0 && message->data[6] != filter->messageType)
+		return 0;
 
-	if(channel < 1 || channel > 8){
-		error("Error: channel out of range (1..8)");
-		return -1;
-	}
+	if(filter->address != ADDRESS_BROADCAST && message->data[5] != filter->address)
+		return 0;
 
-	parameterNumber = (channel-1)*3;
+	return TIME_BEFORE(message->timestamp, filter->since) ? REPLY_STALE : 1;
+}
 
-	dbValue = micstasy_request_value(cMicstasy, parameterNumber);
 
-	if(dbValue != -1) dbValue = dbValue-9;
-	
-	return dbValue;
+static void inbox_remove(struct micstasy_bus *bus, int index)
+{
+	memmove(&bus->inbox[index], &bus->inbox[index+1], (bus->inboxCount-index-1)*sizeof(struct micstasy_sysex));
+	bus->inboxCount--;
 }
 
 
-double micstasy_get_gain(struct micstasy *cMicstasy, int channel, double *dbValue)
+static void inbox_append(struct micstasy_bus *bus, const int8_t *data, int length, PmTimestamp timestamp)
 {
-	int ret;
-	struct micstasy_parameters parameters;
+	if(bus->inboxCount == MICSTASY_INBOX_DEPTH) { /* nobody waits for the oldest reply */
+		if(DEBUG) printf("WARNING: inbox overflow\n");
+		inbox_remove(bus, 0);
+		stats_count(bus, &bus->stats.discarded, 1);
+	}
+
+	bus->inbox[bus->inboxCount].length = length;
+	bus->inbox[bus->inboxCount].timestamp = timestamp;
+	memcpy(bus->inbox[bus->inboxCount].data, data, length);
+	bus->inboxCount++;
+}
+
 
-	ret = micstasy_get_gainCoarse(cMicstasy, channel);
-	if(ret == -1) return -1;
+/* reads pending input and moves complete replies into the inbox;
+   only called by the holder of the reader role */
+static void bus_read_input(struct micstasy_bus *bus)
+{
+	struct micstasy_sysexParser *parser = &bus->parser;
+	unsigned char buffer[MICSTASY_TRANSPORT_CHUNK];
+	PmTimestamp timestamp;
+	int i, count, parsed;
+	uint64_t messages, incomplete, discarded;
+
+	/* reads stop after each EOX, so timestamp dates the message completed */
+	while((count = bus->transport->read(bus->port, buffer, MICSTASY_TRANSPORT_CHUNK, &timestamp)) > 0)
+	{
+		trace_record(bus, MICSTASY_TRACE_IN, buffer, count);
 
-	*dbValue = ret;
+		messages = incomplete = discarded = 0;
 
-	ret = micstasy_get_parameters(cMicstasy, channel, &parameters);
-	if(ret == -1) return -1;
+		mutex_lock(&bus->lock);
 
-	if(parameters.gainFine == 1) *dbValue += 0.5;
+		/* a message whose EOX has not arrived yet stays in the parser
+		   and is completed by the next call */
+		for(i=0; i<count; i++)
+		{
+			parsed = sysex_parse_byte(parser, buffer[i]);
 
-	return ret;
-}
+			if(parsed == -1)
+				incomplete++;
 
+			if(parsed != 1)
+				continue;
 
-int micstasy_get_parameters(struct micstasy *cMicstasy, int channel, struct micstasy_parameters *parameters)
-{
-	char value;
-	int parameterNumber;
+			if(DEBUG) printf("got SysEX data of lenght: %d\n", parser->length);
 
-	if(channel < 1 || channel > 8){
-		error("Error: channel out of range (1..8)");
-		return -1;
+			messages++;
+
+			if(parser->length > 6 && (parser->data[6] == MESSAGETYPE_RESPONSE_VALUE || parser->data[6] == MESSAGETYPE_RESPONSE_LEVELMETER_DATA))
+			{
+				if(DEBUG) print_sysex(parser->data);
+				inbox_append(bus, parser->data, parser->length, timestamp);
+			}
+			else
+				discarded++;
+
+			parser->length = 0;
+		}
+
+		cond_broadcast(&bus->cond);
+		mutex_unlock(&bus->lock);
+
+		mutex_lock(&bus->statsLock);
+		bus->stats.bytesReceived += count;
+		bus->stats.messagesReceived += messages;
+		bus->stats.incomplete += incomplete;
+		bus->stats.discarded += discarded;
+		mutex_unlock(&bus->statsLock);
 	}
+}
 
-	parameterNumber = (channel-1)*3+1;
-	memset(parameters, 0, sizeof(*parameters));
 
-	value = micstasy_request_value(cMicstasy, parameterNumber);
+/* takes the oldest inbox message accepted by match. Without the receiver
+   thread the first waiter becomes the reader and the others wait on bus->cond */
+static int8_t *bus_wait(struct micstasy_bus *bus, reply_match match, void *context, uint64_t deadline, int *length)
+{
+	int8_t *data = NULL;
+	int i, found;
 
-	if(value != -1)
+	*length = 0;
+
+	mutex_lock(&bus->lock);
+
+	while(1)
 	{
-		parameters->channel = channel;
-		parameters->gainFine = value & BIT(0);
-		if(channel == 1) {
-			parameters->digitalOutSelect = (value & BIT(1)) >> 1;
-			parameters->autoSetLink = -1;
-			parameters->displayAutoDark = (value & BIT(6)) >> 6;
+		for(i=0; i<bus->inboxCount; i++)
+		{
+			found = match(&bus->inbox[i], context);
+			if(found == 1)
+				break;
+			if(found == REPLY_STALE) {
+				inbox_remove(bus, i--);
+				stats_count(bus, &bus->stats.discarded, 1);
+			}
 		}
-		else {
-			parameters->autoSetLink = (value & BIT(1)) >> 1;
-			parameters->digitalOutSelect = -1;
-			parameters->displayAutoDark = -1;
+
+		if(i < bus->inboxCount)
+		{
+			*length = bus->inbox[i].length;
+			data = (int8_t *)malloc(*length);
+			memcpy(data, bus->inbox[i].data, *length);
+			inbox_remove(bus, i);
+			break;
 		}
 
-		parameters->levelMeter = (value & (BIT(2) | BIT(3) | BIT(4) | BIT(5))) >> 2;
+		if(clock_us() >= deadline)
+			break;
+
+		if(bus->receiverRunning || bus->reading)
+			cond_wait_until(&bus->cond, &bus->lock, deadline);
+		else
+		{
+			bus->reading = 1;
+			mutex_unlock(&bus->lock);
 
-		if(parameters->levelMeter >= 0 && parameters->levelMeter < 14)
-			parameters->levelMeter = levelMeterLookupTable[parameters->levelMeter];
-		else parameters->levelMeter = 0;
+			if(wait_for_input(bus, deadline))
+				bus_read_input(bus);
 
+			mutex_lock(&bus->lock);
+			bus->reading = 0;
+			cond_broadcast(&bus->cond);
+		}
 	}
 
-	return value;
+	mutex_unlock(&bus->lock);
+
+	return data;
 }
 
-int micstasy_get_settings(struct micstasy *cMicstasy, int channel, struct micstasy_settings *settings)
+
+static THREAD_FUNCTION(receiver_thread)
 {
-	char value;
-	int parameterNumber;
+	struct micstasy_bus *bus = (struct micstasy_bus *)arg;
 
-	if(channel < 1 || channel > 8){
-		error("Error: channel out of range (1..8)");
+	while(bus->receiverRunning)
+		if(wait_for_input(bus, clock_us()+RECEIVER_WAKEUP_US))
+			bus_read_input(bus);
+
+	return THREAD_RETURN;
+}
+
+
+int micstasy_receiver_start(struct micstasy *cMicstasy)
+{
+	struct micstasy_bus *bus = cMicstasy->bus;
+
+	mutex_lock(&bus->lock);
+
+	if(bus->receiverRunning) {
+		mutex_unlock(&bus->lock);
+		return 1;
+	}
+
+	/* take over the reader role from a foreground waiter */
+	while(bus->reading)
+		cond_wait_until(&bus->cond, &bus->lock, clock_us()+RECEIVER_WAKEUP_US);
+
+	bus->receiverRunning = 1;
+
+	if(thread_create(&bus->receiverThread, receiver_thread, bus) == -1) {
+		bus->receiverRunning = 0;
+		mutex_unlock(&bus->lock);
+		error(MICSTASY_ERROR_SYSTEM, "Error: unable to start receiver thread");
 		return -1;
 	}
 
-	memset(settings, -1, sizeof(*settings));
+	mutex_unlock(&bus->lock);
 
-	parameterNumber = (channel-1)*3+2;
+	return 1;
+}
 
-	value = micstasy_request_value(cMicstasy, parameterNumber);
 
-	if(value != -1)
+int micstasy_receiver_stop(struct micstasy *cMicstasy)
+{
+	struct micstasy_bus *bus = cMicstasy->bus;
+
+	if(!bus->receiverRunning)
+		return 1;
+
+	bus->receiverRunning = 0;
+	thread_join(bus->receiverThread);
+
+	/* foreground waiters take over reading */
+	mutex_lock(&bus->lock);
+	cond_broadcast(&bus->cond);
+	mutex_unlock(&bus->lock);
+
+	return 1;
+}
+
+
+/* sends a request and waits for its reply. Input is not flushed first:
+   replies received before the request went out are dropped as stale */
+static int8_t *sysex_request(struct micstasy *cMicstasy, int messageType, int *length)
+{
+	uint64_t deadline;
+	struct reply_filter filter;
+	int8_t *data = NULL;
+	uint64_t start;
+	int attempt;
+
+	filter.address = (cMicstasy->bankNumber<<4) | cMicstasy->deviceID;
+	filter.messageType = messageType+0x20; /* REQUEST_x -> RESPONSE_x */
+
+	*length = 0;
+
+	for(attempt = 0; attempt <= cMicstasy->retries; attempt++)
 	{
-		settings->channel = channel;
-		settings->input = value & BIT(0);
-		settings->HiZ = (value & BIT(1))>>1;
-		settings->autoset  = (value & BIT(2))>>2;
-		settings->loCut = (value & BIT(3))>>3;
+		if(attempt > 0)
+			stats_count(cMicstasy->bus, &cMicstasy->bus->stats.retries, 1);
+
+		/* a late answer to an earlier attempt is as good as any */
+		if(attempt == 0)
+			filter.since = bus_time(NULL);
+		start = clock_us();
+
+		if(sysex_message_send_data(cMicstasy, messageType, NULL, 0) == -1)
+			return NULL;
+
+		if(DEBUG) printf("reading\n");
 
-		if( channel != 1 && channel != 3 && channel != 5 && channel != 7 )
-			settings->MS = -1;
-		else settings->MS = (value & BIT(4))>>4;
+		deadline = clock_us() + (uint64_t)cMicstasy->timeout*1000;
+		data = bus_wait(cMicstasy->bus, reply_filter_match, &filter, deadline, length);
 
-		settings->phase = (value & BIT(5))>>5;
-		settings->p48 = (value & BIT(6))>>6;
+		if(data != NULL) {
+			stats_latency(cMicstasy->bus, messageType == MESSAGETYPE_REQUEST_VALUE ? MICSTASY_STAT_REQUEST : MICSTASY_STAT_LEVELMETER, start);
+			return data;
+		}
+
+		stats_count(cMicstasy->bus, &cMicstasy->bus->stats.timeouts, 1);
 	}
 
-	return value;
+	*length = 0;
+	error(MICSTASY_ERROR_TIMEOUT, "no response from micstasy");
+
+	return NULL;
 }
 
 
-int micstasy_set_parameters(struct micstasy *cMicstasy, int channel, boolean gainFine, boolean displayAutoDark, boolean autoSetLink, boolean digitalOutSelect)
+int micstasy_set_timeout(struct micstasy *cMicstasy, int timeoutMs)
 {
-	int parameterNumber;
-	char value = 0, ret;
-
-	if(channel < 1 || channel > 8){
-		error("Error: channel out of range (1..8)");
+	if(timeoutMs <= 0){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: timeout must be positive (ms)");
 		return -1;
 	}
 
-	if(displayAutoDark != -1 && channel != 1){
-		error("Error: Display auto dark only available on channel 1");
+	cMicstasy->timeout = timeoutMs;
+
+	return 1;
+}
+
+
+/* requests are sent up to 1+retries times, each waiting the full timeout */
+int micstasy_set_retries(struct micstasy *cMicstasy, int retries)
+{
+	if(retries < 0){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: retries must not be negative");
 		return -1;
 	}
-	if(autoSetLink != -1 && channel == 1){
-		error("Error: AutoSet link only available on channel 2..8");
-		return -1;	
-	}
-	if(digitalOutSelect != -1 && channel != 1){
-		error("Error: digital out selection only available on channel 1");
-		return -1;	
+
+	cMicstasy->retries = retries;
+
+	return 1;
+}
+
+
+/* how many parameter/value pairs go into one SET_VALUE message on the bus,
+   see MICSTASY_DEFAULT_SET_PAIRS */
+int micstasy_set_max_pairs(struct micstasy_bus *bus, int pairs)
+{
+	if(pairs < 1 || pairs > MICSTASY_MAX_SET_PAIRS){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: pairs per message out of range (1..32)");
+		return -1;
 	}
 
+	bus->setPairs = pairs;
 
-	parameterNumber = (channel-1)*3+1;
+	return 1;
+}
 
-	if(displayAutoDark == 1)	/* 0=off, 1=on */
-		value |= (1<<6);
 
-	if(gainFine == 1)		/* 0=0dB, 1=+0.5db */
-		value |= (1<<0);
+/* copies the statistics of the bus and optionally starts them over */
+int micstasy_get_stats(struct micstasy_bus *bus, struct micstasy_stats *stats, boolean reset)
+{
+	uint32_t overflows = 0;
 
-	/* AutoSet Link: 0 = off, 1 = link to lower channel
-	  channel 1: digital out AES/ADAT 0 = analog, 1 = Option */
-	if(autoSetLink == 1 || digitalOutSelect == 1) 						
-		value |= (1<<1);
+	if(stats == NULL && !reset){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: no stats given");
+		return -1;
+	}
 
+	mutex_lock(&bus->statsLock);
 
-	ret = micstasy_set_value(cMicstasy, parameterNumber, value);
+	if(bus->transport->overflows != NULL)
+		overflows = bus->transport->overflows(bus->port);
 
-	return ret;
+	if(stats != NULL) {
+		*stats = bus->stats;
+		stats->readOverflows = overflows - bus->readOverflowsReset;
+	}
+
+	if(reset) {
+		memset(&bus->stats, 0, sizeof(struct micstasy_stats));
+		bus->readOverflowsReset = overflows;
+	}
+
+	mutex_unlock(&bus->statsLock);
+
+	return 1;
 }
 
 
-int micstasy_set_settings(struct micstasy *cMicstasy, int channel,
-		 boolean input, boolean HiZ, boolean autoset, boolean loCut, boolean MS, boolean phase, boolean p48)
+/* upper bound in us of the given percentile (0..100), from the buckets */
+uint64_t micstasy_stats_percentile(const struct micstasy_histogram *histogram, double percentile)
 {
+	uint64_t rank, seen = 0;
+	int bucket;
 
-	int ret, parameterNumber;
-	char value = 0;
+	if(histogram->count == 0)
+		return 0;
 
-	if(channel < 1 || channel > 8){
-		error("Error: channel out of range (1..8)");
-		return -1;
+	rank = (uint64_t)(histogram->count * percentile / 100.0 + 0.5);
+	if(rank < 1)
+		rank = 1;
+
+	for(bucket=0; bucket<MICSTASY_STATS_BUCKETS-1; bucket++)
+	{
+		seen += histogram->buckets[bucket];
+		if(seen >= rank)
+			break;
 	}
 
-	if(MS != -1 && (channel != 1 && channel != 3 && channel != 5 && channel != 7) ){
-		error("Error: M/S only available on channel 1,3,5,7");
-		return -1;
-	}	
+	if(bucket == MICSTASY_STATS_BUCKETS-1 || ((uint64_t)2 << bucket) - 1 > histogram->maxUs)
+		return histogram->maxUs;
 
-	parameterNumber = (channel-1)*3+2;	
+	return ((uint64_t)2 << bucket) - 1;
+}
 
 
-	if(input == 1)		/* Input: 0 = rear, 1 = front */
-		value |= (1<<0);
-	if(HiZ == 1)		/* Hi Z: 0 = off, 1 = on */
-		value |= (1<<1);
-	if(autoset == 1)	/* Autoset: 0 = off, 1 = on */
-		value |= (1<<2);
-	if(loCut == 1)		/* Lo Cut: 0 = off, 1 = on */
-		value |= (1<<3);
-	if(MS == 1)		/* M/S: 0 = off, 1 = on (set only ch. 1, 3, 5,7) */
-		value |= (1<<4);
-	if(phase == 1)		/* Phase: 0 = normal, 1 = inverted */
-		value |= (1<<5);
-	if(p48 == 1)		/* P48: 0 = off, 1 = on */
-		value |= (1<<6);
 
+/* a bus on any transport; port is closed with the bus, also when opening fails */
+struct micstasy_bus *micstasy_bus_open_transport(const struct micstasy_transport *transport, void *port)
+{
+	struct micstasy_bus *nBus;
 
-	ret = micstasy_set_value(cMicstasy, parameterNumber, value);
+	nBus = (struct micstasy_bus *) calloc(1, sizeof(struct micstasy_bus));
+	if(nBus == NULL) {
+		transport->close(port);
+		error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+		return NULL;
+	}
 
-	return ret;
+	nBus->transport = transport;
+	nBus->port = port;
+	nBus->setPairs = MICSTASY_DEFAULT_SET_PAIRS;
+	mutex_init(&nBus->sendLock);
+	mutex_init(&nBus->statsLock);
+	mutex_init(&nBus->traceLock);
+	mutex_init(&nBus->lock);
+	cond_init(&nBus->cond);
+	cond_init(&nBus->asyncCond);
+	cond_init(&nBus->scheduleCond);
+	cond_init(&nBus->meterCond);
+
+	return nBus;
 }
 
 
-int micstasy_setup(struct micstasy *cMicstasy, boolean intFreq, int clockRange, int clockSelect,
-	 int analogOutput, boolean lockKeys, boolean peakHold, boolean followClock, int autosetLimit, boolean delayCompensation, boolean autoDevice)
+struct micstasy_bus *micstasy_bus_open(int midiDeviceIn, int midiDeviceOut)
 {
+	struct pm_port *port;
+	PmError ret;
+	PortMidiStream *stream;
+	long bufferSize = 100;
 
-	int ret, parameterNumber;
-	char value;
-
-	if(clockRange < 0 || clockRange > 2){
-		error("Error: clock range out of range 0..2");
-		return -1;
-	}	
-	if(clockSelect < 0 || clockSelect > 3){
-		error("Error: clock select out of range 0..3");
-		return -1;
+	port = (struct pm_port *) calloc(1, sizeof(struct pm_port));
+	if(port == NULL) {
+		error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+		return NULL;
 	}
-	if(analogOutput < 0 || analogOutput > 2){
-		error("Error: analog output out of range 0..2");
-		return -1;
-	}	
-	if(autosetLimit < 0 || autosetLimit > 3){
-		error("Error: autoset limit out of range 0..3");
-		return -1;
-	}	
 
-	parameterNumber = 0x18; /* setup 1 */
-	value = 0;
+	if(DEBUG) printf("connecting to micstasy\n");
 
-	if(intFreq == 1)
-		value |= (1<<0); /* int. freq.: 0 = 44.1kHz, 1 = 48kHz (don't care for clock sel > 0) */
-	
-	value |= (clockRange << 1); /* clock range: 0 = single speed, 1 = ds, 2= qs */
-	value |= (clockSelect << 3); /* clock select: 0 = int., 1 = Option, 2 = AES, 3 = WCK */
-	value |= (analogOutput << 5); /* analog output: 0 = +13dBu, 1 =+19dBu, 2 = +24dBu */
 
-	ret = micstasy_set_value(cMicstasy, parameterNumber, value);
-	if(ret == -1) return -1;
 
-	parameterNumber = 0x19; /* setup 2 */
-	value = 0;
 
-	if(lockKeys == 1)
-		value |= (1<<0); /* Lock Keys: 0 = unlock, 1 = lock */
-	if(peakHold == 1)
-		value |= (1<<1); /* Peak Hold: 0 = off, 1 = on */
-	if(followClock == 1)
-		value |= (1<<2); /* Follow Clock: 0 = off, 1 = on */
+	if(DEBUG) printf("opening output device %d\n", midiDeviceOut);
+	ret = Pm_OpenOutput(&stream,
+		         midiDeviceOut,
+		         NULL,
+		         bufferSize,
+		         NULL,
+		         NULL,
+		         0);
+
+	if(DEBUG) printf("Returned %d\n", ret);
+	if(ret != pmNoError) {
+		error(MICSTASY_ERROR_MIDI, Pm_GetErrorText(ret));
+		free(port);
+		return NULL;
+	}
+
+	port->out = stream;
+
+
+	if(DEBUG) printf("opening input device %d\n", midiDeviceIn);
+	ret = Pm_OpenInput(&stream,
+		         midiDeviceIn,
+		         NULL,
+		         bufferSize,
+		         bus_time,
+		         NULL
+		         );
+
+
+	if(DEBUG) printf("returned: %d\n", ret);
+	if(ret != pmNoError) {
+		error(MICSTASY_ERROR_MIDI, Pm_GetErrorText(ret));
+		Pm_Close(port->out);
+		free(port);
+		return NULL;
+	}
+
+	port->in = stream;
+
+	/* keep clock and active sensing from waking up the receive path */
+	Pm_SetFilter(stream, PM_FILT_ACTIVE | PM_FILT_CLOCK | PM_FILT_TICK);
+
+	cbInit(&port->events, READ_BUFFER_SIZE);
+	if(port->events.elems == NULL) {
+		error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+		Pm_Close(port->in);
+		Pm_Close(port->out);
+		free(port);
+		return NULL;
+	}
+
+	return micstasy_bus_open_transport(&pm_transport, port);
+}
+
+
+/* device is an ALSA rawmidi name such as "hw:1,0,0" */
+struct micstasy_bus *micstasy_bus_open_rawmidi(const char *device)
+{
+#ifdef MICSTASY_HAVE_ALSA
+	struct rawmidi_port *port;
+
+	port = (struct rawmidi_port *) calloc(1, sizeof(struct rawmidi_port));
+	if(port == NULL) {
+		error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+		return NULL;
+	}
+
+	if(snd_rawmidi_open(&port->in, NULL, device, SND_RAWMIDI_NONBLOCK) < 0) {
+		error(MICSTASY_ERROR_MIDI, "Error: cannot open rawmidi input");
+		free(port);
+		return NULL;
+	}
+
+	if(snd_rawmidi_open(NULL, &port->out, device, 0) < 0) {
+		error(MICSTASY_ERROR_MIDI, "Error: cannot open rawmidi output");
+		snd_rawmidi_close(port->in);
+		free(port);
+		return NULL;
+	}
+
+	if(snd_rawmidi_poll_descriptors(port->in, &port->pollfd, 1) != 1) {
+		error(MICSTASY_ERROR_MIDI, "Error: rawmidi input cannot be polled");
+		snd_rawmidi_close(port->in);
+		snd_rawmidi_close(port->out);
+		free(port);
+		return NULL;
+	}
+
+	return micstasy_bus_open_transport(&rawmidi_transport, port);
+#else
+	(void)device;
+
+	error(MICSTASY_ERROR_STATE, "Error: built without ALSA rawmidi support");
+	return NULL;
+#endif
+}
+
+
+/* an in-memory bus without units, for tests and replaying traffic */
+struct micstasy_bus *micstasy_bus_open_loopback(boolean echo)
+{
+	struct micstasy_loopback *port;
+
+	port = (struct micstasy_loopback *) calloc(1, sizeof(struct micstasy_loopback));
+	if(port == NULL) {
+		error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+		return NULL;
+	}
+
+	port->echo = echo;
+	mutex_init(&port->lock);
+
+	return micstasy_bus_open_transport(&loopback_transport, port);
+}
+
+
+/* queues bytes as if they had just arrived on the loopback bus */
+int micstasy_loopback_inject(struct micstasy_bus *bus, const unsigned char *bytes, int length)
+{
+	if(bus->transport != &loopback_transport){
+		error(MICSTASY_ERROR_STATE, "Error: not a loopback bus");
+		return -1;
+	}
+
+	loopback_put((struct micstasy_loopback *)bus->port, bytes, length);
+
+	return 1;
+}
+
+
+/* descriptor that becomes readable with input, for select/poll/epoll; the
+   library still reads it itself. -1 if the transport has none */
+int micstasy_bus_fd(struct micstasy_bus *bus)
+{
+	if(bus->transport->fd == NULL)
+		return -1;
+
+	return bus->transport->fd(bus->port);
+}
+
+
+/* a lightweight handle for one unit on the bus, released with micstasy_close() */
+struct micstasy *micstasy_bus_unit(struct micstasy_bus *bus, int bankNumber, int deviceID)
+{
+	struct micstasy *nMicstasy;
+
+	nMicstasy = (struct micstasy *) calloc(1, sizeof(struct micstasy));
+	if(nMicstasy == NULL) {
+		error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+		return NULL;
+	}
+
+	nMicstasy->bankNumber = bankNumber;
+	nMicstasy->deviceID = deviceID;
+	nMicstasy->timeout = MICSTASY_DEFAULT_TIMEOUT;
+	nMicstasy->bus = bus;
+	mutex_init(&nMicstasy->lock);
+
+	mutex_lock(&bus->lock);
+	nMicstasy->next = bus->units;
+	bus->units = nMicstasy;
+	mutex_unlock(&bus->lock);
+
+	return nMicstasy;
+}
+
+
+int micstasy_bus_close(struct micstasy_bus *bus)
+{
+	struct micstasy *unit;
+
+	meter_thread_stop(bus);
+	async_thread_stop(bus);
+	scheduler_thread_stop(bus);
+
+	if(bus->receiverRunning) {
+		bus->receiverRunning = 0;
+		thread_join(bus->receiverThread);
+	}
+
+	while(bus->units != NULL) {
+		unit = bus->units;
+		bus->units = unit->next;
+		mutex_destroy(&unit->lock);
+		free(unit);
+	}
+
+	micstasy_trace_stop(bus);
+	bus->transport->close(bus->port);
+	mutex_destroy(&bus->sendLock);
+	mutex_destroy(&bus->statsLock);
+	mutex_destroy(&bus->traceLock);
+	mutex_destroy(&bus->lock);
+	cond_destroy(&bus->cond);
+	cond_destroy(&bus->asyncCond);
+	cond_destroy(&bus->scheduleCond);
+	cond_destroy(&bus->meterCond);
+	free(bus);
+
+	return 1;
+}
+
+
+struct micstasy *micstasy_init(int midiDeviceIn, int midiDeviceOut, int bankNumber, int deviceID)
+{
+	struct micstasy_bus *bus;
+	struct micstasy *nMicstasy;
+
+	bus = micstasy_bus_open(midiDeviceIn, midiDeviceOut);
+	if(bus == NULL)
+		return NULL;
+
+	nMicstasy = micstasy_bus_unit(bus, bankNumber, deviceID);
+	if(nMicstasy == NULL) {
+		micstasy_bus_close(bus);
+		return NULL;
+	}
+
+	nMicstasy->ownsBus = 1;
+
+	return nMicstasy;
+}
+
+
+/* records all traffic of the bus to filePath until micstasy_trace_stop() */
+int micstasy_trace_start(struct micstasy_bus *bus, const char *filePath)
+{
+	struct micstasy_traceFileHeader header;
+	FILE *traceFile;
+
+	traceFile = fopen(filePath, "wb");
+	if(traceFile == NULL) {
+		error(MICSTASY_ERROR_FILE, "ERROR: unable to open file");
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MICSTASY_TRACE_MAGIC, 4);
+	header.version = MICSTASY_TRACE_VERSION;
+
+	if(fwrite(&header, sizeof(header), 1, traceFile) != 1) {
+		fclose(traceFile);
+		error(MICSTASY_ERROR_FILE, "ERROR: unable to write file");
+		return -1;
+	}
+
+	micstasy_trace_stop(bus);
+
+	mutex_lock(&bus->traceLock);
+	bus->trace = traceFile;
+	bus->traceTime = clock_us();
+	mutex_unlock(&bus->traceLock);
+
+	return 1;
+}
+
+
+int micstasy_trace_stop(struct micstasy_bus *bus)
+{
+	mutex_lock(&bus->traceLock);
+	if(bus->trace != NULL) {
+		fclose(bus->trace);
+		bus->trace = NULL;
+	}
+	mutex_unlock(&bus->traceLock);
+
+	return 1;
+}
+
+
+/* returns -1 at the end of the data or on a varint longer than 64 bits */
+static int read_varint(const unsigned char *data, size_t size, size_t *position, uint64_t *value)
+{
+	int shift;
+
+	*value = 0;
+
+	for(shift = 0; shift < 64 && *position < size; shift += 7)
+	{
+		*value |= (uint64_t)(data[*position] & 0x7F) << shift;
+		if(!(data[(*position)++] & 0x80))
+			return 1;
+	}
+
+	return -1;
+}
+
+
+struct micstasy_trace *micstasy_trace_load(const char *filePath)
+{
+	struct micstasy_trace *trace;
+	struct micstasy_traceRecord *records;
+	FILE *traceFile;
+	long fileSize;
+	size_t size, position;
+	uint64_t time = 0, delta, length;
+	int direction, capacity = 0;
+
+	traceFile = fopen(filePath, "rb");
+	if(traceFile == NULL) {
+		error(MICSTASY_ERROR_FILE, "ERROR: unable to open file");
+		return NULL;
+	}
+
+	trace = (struct micstasy_trace *) calloc(1, sizeof(struct micstasy_trace));
+	if(trace == NULL) {
+		fclose(traceFile);
+		error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+		return NULL;
+	}
+
+	if(fseek(traceFile, 0, SEEK_END) != 0 || (fileSize = ftell(traceFile)) < 0 || fseek(traceFile, 0, SEEK_SET) != 0) {
+		fclose(traceFile);
+		free(trace);
+		error(MICSTASY_ERROR_FILE, "ERROR: unable to read file");
+		return NULL;
+	}
+
+	size = (size_t)fileSize;
+	trace->data = (unsigned char *) malloc(size > 0 ? size : 1);
+	if(trace->data == NULL) {
+		fclose(traceFile);
+		free(trace);
+		error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+		return NULL;
+	}
+
+	if(fread(trace->data, 1, size, traceFile) != size) {
+		fclose(traceFile);
+		micstasy_trace_free(trace);
+		error(MICSTASY_ERROR_FILE, "ERROR: unable to read file");
+		return NULL;
+	}
+	fclose(traceFile);
+
+	if(size < sizeof(struct micstasy_traceFileHeader) || memcmp(trace->data, MICSTASY_TRACE_MAGIC, 4) != 0 ||
+	   ((const struct micstasy_traceFileHeader *)trace->data)->version != MICSTASY_TRACE_VERSION) {
+		micstasy_trace_free(trace);
+		error(MICSTASY_ERROR_FILE, "ERROR: not a micstasy trace file of this version");
+		return NULL;
+	}
+
+	/* a session cut short may end in a partial record, which is ignored */
+	position = sizeof(struct micstasy_traceFileHeader);
+
+	while(position < size)
+	{
+		direction = trace->data[position++];
+		if(direction != MICSTASY_TRACE_OUT && direction != MICSTASY_TRACE_IN) {
+			micstasy_trace_free(trace);
+			error(MICSTASY_ERROR_FILE, "ERROR: corrupt trace file");
+			return NULL;
+		}
+
+		if(read_varint(trace->data, size, &position, &delta) == -1 || read_varint(trace->data, size, &position, &length) == -1 ||
+		   length > size - position)
+			break;
+
+		if(trace->recordCount == capacity) {
+			capacity = capacity > 0 ? 2*capacity : 256;
+			records = (struct micstasy_traceRecord *) realloc(trace->records, capacity*sizeof(struct micstasy_traceRecord));
+			if(records == NULL) {
+				micstasy_trace_free(trace);
+				error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+				return NULL;
+			}
+			trace->records = records;
+		}
+
+		time += delta;
+		trace->records[trace->recordCount].direction = direction;
+		trace->records[trace->recordCount].time = time;
+		trace->records[trace->recordCount].length = (int)length;
+		trace->records[trace->recordCount].data = trace->data + position;
+		trace->recordCount++;
+
+		position += (size_t)length;
+	}
+
+	return trace;
+}
+
+
+int micstasy_trace_free(struct micstasy_trace *trace)
+{
+	free(trace->records);
+	free(trace->data);
+	free(trace);
+
+	return 1;
+}
+
+
+/* replay transport: plays the recorded input back once the output that
+   preceded it has been written, at its recorded distance or immediately */
+struct replay_port {
+	const struct micstasy_trace *trace;
+	boolean realtime;
+	micstasy_mutex lock;		/* guards everything below */
+	int nextOut;			/* first outbound record not written yet */
+	int next;			/* next record to deliver */
+	int offset;			/* bytes of it delivered */
+	uint64_t anchor;		/* us, when the last outbound record was written */
+	uint64_t anchorTrace;		/* us, its trace time */
+	uint32_t mismatches;
+};
+
+static int replay_next_out(const struct micstasy_trace *trace, int index)
+{
+	while(index < trace->recordCount && trace->records[index].direction != MICSTASY_TRACE_OUT)
+		index++;
+
+	return index;
+}
+
+static int replay_write_sysex(void *port, const unsigned char *msg)
+{
+	struct replay_port *replay = (struct replay_port *)port;
+	const struct micstasy_traceRecord *record;
+	int length;
+
+	for(length=0; length < MICSTASY_MAX_SYSEX_LENGTH && msg[length] != 0xF7; length++);
+	length++;
+
+	mutex_lock(&replay->lock);
+
+	if(replay->nextOut < replay->trace->recordCount)
+	{
+		record = &replay->trace->records[replay->nextOut];
+		if(record->length != length || memcmp(record->data, msg, length) != 0)
+			replay->mismatches++;
+
+		replay->anchor = clock_us();
+		replay->anchorTrace = record->time;
+		replay->nextOut = replay_next_out(replay->trace, replay->nextOut+1);
+	}
+	else
+		replay->mismatches++;
+
+	mutex_unlock(&replay->lock);
+
+	return 1;
+}
+
+/* 1 when record next can be delivered. Called with replay->lock held */
+static int replay_ready(struct replay_port *replay, uint64_t now)
+{
+	const struct micstasy_traceRecord *record;
+
+	/* outbound records are consumed by writes */
+	while(replay->next < replay->nextOut && replay->trace->records[replay->next].direction == MICSTASY_TRACE_OUT)
+		replay->next++;
+
+	if(replay->next >= replay->nextOut)
+		return 0;
+
+	record = &replay->trace->records[replay->next];
+
+	return !replay->realtime || record->time <= replay->anchorTrace || now >= replay->anchor + (record->time - replay->anchorTrace);
+}
+
+static int replay_read(void *port, unsigned char *buffer, int length, PmTimestamp *timestamp)
+{
+	struct replay_port *replay = (struct replay_port *)port;
+	const struct micstasy_traceRecord *record;
+	int count = 0;
+
+	mutex_lock(&replay->lock);
+
+	while(count < length && replay_ready(replay, clock_us()))
+	{
+		record = &replay->trace->records[replay->next];
+
+		buffer[count] = record->data[replay->offset++];
+		if(replay->offset == record->length) {
+			replay->next++;
+			replay->offset = 0;
+		}
+
+		if(buffer[count++] == 0xF7)
+			break;
+	}
+
+	*timestamp = bus_time(NULL);
+
+	mutex_unlock(&replay->lock);
+
+	return count;
+}
+
+static int replay_poll(void *port)
+{
+	struct replay_port *replay = (struct replay_port *)port;
+	int ready;
+
+	mutex_lock(&replay->lock);
+	ready = replay_ready(replay, clock_us());
+	mutex_unlock(&replay->lock);
+
+	return ready;
+}
+
+static int replay_close(void *port)
+{
+	struct replay_port *replay = (struct replay_port *)port;
+
+	mutex_destroy(&replay->lock);
+	free(replay);
+
+	return 1;
+}
+
+static const struct micstasy_transport replay_transport = {
+	"replay",
+	replay_write_sysex,
+	replay_read,
+	replay_poll,
+	NULL,
+	NULL,
+	NULL,
+	replay_close
+};
+
+
+/* a request of the recorded session still waiting for its reply */
+struct replay_request {
+	int8_t address;
+	int8_t messageType;
+	PmTimestamp since;
+	uint64_t sent;		/* us */
+};
+
+/* runs a recorded session through the parser, inbox and reply matching
+   again: outbound messages are resent in order (in realtime mode at their
+   recorded distance), and wherever the recording received a reply the
+   replay waits for it like the request that caused it did */
+int micstasy_replay(const char *filePath, boolean realtime, int timeoutMs, struct micstasy_replayResult *result)
+{
+	struct micstasy_trace *trace;
+	struct replay_port *port;
+	struct micstasy_bus *bus;
+	struct micstasy_sysexParser parser;
+	struct replay_request *pending;
+	struct reply_filter filter;
+	const struct micstasy_traceRecord *record;
+	int8_t *reply;
+	int pendingCount = 0, i, j, k, length;
+	uint64_t start, now, firstOut;
+
+	if(timeoutMs <= 0){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: timeout must be positive (ms)");
+		return -1;
+	}
+
+	trace = micstasy_trace_load(filePath);
+	if(trace == NULL)
+		return -1;
+
+	memset(result, 0, sizeof(struct micstasy_replayResult));
+	memset(&parser, 0, sizeof(parser));
+	pending = (struct replay_request *) malloc((trace->recordCount+1)*sizeof(struct replay_request));
+	port = (struct replay_port *) calloc(1, sizeof(struct replay_port));
+	if(pending == NULL || port == NULL) {
+		free(pending);
+		free(port);
+		micstasy_trace_free(trace);
+		return error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+	}
+
+	port->trace = trace;
+	port->realtime = realtime;
+	port->nextOut = replay_next_out(trace, 0);
+	mutex_init(&port->lock);
+
+	/* time runs from the first message sent, not from micstasy_trace_start() */
+	firstOut = port->nextOut < trace->recordCount ? trace->records[port->nextOut].time : 0;
+	port->anchorTrace = firstOut;
+
+	bus = micstasy_bus_open_transport(&replay_transport, port);
+	if(bus == NULL) {
+		free(pending);
+		micstasy_trace_free(trace);
+		return -1;
+	}
+
+	start = clock_us();
+	port->anchor = start;
+
+	for(i=0; i<trace->recordCount; i++)
+	{
+		record = &trace->records[i];
+
+		if(record->direction == MICSTASY_TRACE_OUT)
+		{
+			if(record->length < 8 || record->data[0] != 0xF0 || record->data[record->length-1] != 0xF7)
+				continue;
+
+			if(realtime && (now = clock_us()) < start + (record->time - firstOut))
+				sleep_us(start + (record->time - firstOut) - now);
+
+			if(record->data[6] == MESSAGETYPE_REQUEST_VALUE || record->data[6] == MESSAGETYPE_REQUEST_LEVELMETER_DATA) {
+				pending[pendingCount].address = record->data[5];
+				pending[pendingCount].messageType = record->data[6];
+				pending[pendingCount].since = bus_time(NULL);
+				pending[pendingCount].sent = clock_us();
+			}
+
+			if(sysex_write(bus, record->data[5], record->data[6], (const int8_t *)record->data+7, record->length-8) == -1)
+				continue;
+
+			result->messagesSent++;
+			if(record->data[6] == MESSAGETYPE_REQUEST_VALUE || record->data[6] == MESSAGETYPE_REQUEST_LEVELMETER_DATA)
+				pendingCount++;
+
+			continue;
+		}
+
+		/* find the replies completed by this record */
+		for(j=0; j<record->length; j++)
+		{
+			if(sysex_parse_byte(&parser, record->data[j]) != 1)
+				continue;
+
+			if(parser.length > 6 && (parser.data[6] == MESSAGETYPE_RESPONSE_VALUE || parser.data[6] == MESSAGETYPE_RESPONSE_LEVELMETER_DATA))
+			{
+				/* the oldest request this reply answers */
+				for(k=0; k<pendingCount; k++)
+					if(pending[k].messageType+0x20 == parser.data[6] &&
+					   (pending[k].address == parser.data[5] || pending[k].address == ADDRESS_BROADCAST))
+						break;
+
+				if(k < pendingCount)
+				{
+					filter.address = parser.data[5];
+					filter.messageType = parser.data[6];
+					filter.since = pending[k].since;
+
+					reply = bus_wait(bus, reply_filter_match, &filter, clock_us() + (uint64_t)timeoutMs*1000, &length);
+
+					if(reply != NULL) {
+						result->repliesTaken++;
+						stats_latency(bus, pending[k].messageType == MESSAGETYPE_REQUEST_VALUE ? MICSTASY_STAT_REQUEST : MICSTASY_STAT_LEVELMETER, pending[k].sent);
+						free(reply);
+					}
+					else {
+						result->repliesMissed++;
+						stats_count(bus, &bus->stats.timeouts, 1);
+					}
+
+					/* a broadcast request keeps collecting replies */
+					if(pending[k].address != ADDRESS_BROADCAST) {
+						memmove(&pending[k], &pending[k+1], (pendingCount-k-1)*sizeof(struct replay_request));
+						pendingCount--;
+					}
+				}
+			}
+
+			parser.length = 0;
+		}
+	}
+
+	for(k=0; k<pendingCount; k++)
+		if(pending[k].address != ADDRESS_BROADCAST)
+			result->unanswered++;
+
+	result->elapsedUs = clock_us() - start;
+
+	mutex_lock(&port->lock);
+	result->mismatches = port->mismatches;
+	mutex_unlock(&port->lock);
+
+	micstasy_get_stats(bus, &result->stats, 0);
+
+	micstasy_bus_close(bus);
+	free(pending);
+	micstasy_trace_free(trace);
+
+	return 1;
+}
+
+
+static void parse_registers(const int8_t *response, int length, int8_t *registers)
+{
+	int i;
+
+	for(i=0; i<MICSTASY_REGISTER_COUNT; i++)
+		registers[i] = -1;
+
+	/* F0 00 20 0D 68 (bank no. / dev ID) 30 (par. no.) (value) (par. no.) (value) ... F7 */
+	for(i=7; i+1 < length-1; i+=2)
+		if(response[i] >= 0 && response[i] < MICSTASY_REGISTER_COUNT)
+			registers[(int)response[i]] = response[i+1];
+}
+
+
+static int request_registers(struct micstasy *cMicstasy, int8_t *registers)
+{
+	int8_t *response;
+	int length=0;
+
+	response = sysex_request(cMicstasy, MESSAGETYPE_REQUEST_VALUE, &length);
+
+	if(response == NULL)
+		return -1;
+
+	parse_registers(response, length, registers);
+
+	free(response);
+
+	return 1;
+}
+
+
+/* shadow cache: lock/sync (0x1A) is live status and never served from the cache.
+   All shadow fields are guarded by cMicstasy->lock */
+#define SHADOW_CACHEABLE (BIT(0x1A)-1)
+
+static int shadow_is_fresh(struct micstasy *cMicstasy, uint32_t registerMask)
+{
+	if(!cMicstasy->shadowEnabled)
+		return 0;
+
+	if((cMicstasy->shadowValid & registerMask) != registerMask)
+		return 0;
+
+	if(cMicstasy->shadowTimeout > 0 &&
+	   clock_us() - cMicstasy->shadowTime > (uint64_t)cMicstasy->shadowTimeout * 1000)
+		return 0;
+
+	return 1;
+}
+
+
+/* bits of a register that SET_VALUE changes */
+static int8_t writable_bits(int parameterNumber)
+{
+	/* level meter bits of the parameters register are read only */
+	if(parameterNumber < 0x18 && parameterNumber%3 == 1)
+		return 0x43;
+
+	return 0x7F;
+}
+
+
+/* per channel copy of the parameters registers, see channelParameters */
+static void parameters_update(struct micstasy *cMicstasy, int parameterNumber, int8_t value)
+{
+	mutex_lock(&cMicstasy->lock);
+
+	if(parameterNumber == 0x1C || parameterNumber == 0x1D)
+		cMicstasy->channelParametersKnown = 0;
+	else if(parameterNumber >= 0 && parameterNumber < 0x18 && parameterNumber%3 == 1 && value != -1) {
+		cMicstasy->channelParameters[parameterNumber/3] = value & writable_bits(parameterNumber);
+		cMicstasy->channelParametersKnown |= BIT(parameterNumber/3);
+	}
+
+	mutex_unlock(&cMicstasy->lock);
+}
+
+
+static int parameters_known(struct micstasy *cMicstasy, int channel, int8_t *value)
+{
+	int known;
+
+	mutex_lock(&cMicstasy->lock);
+	known = (cMicstasy->channelParametersKnown >> (channel-1)) & 1;
+	if(known)
+		*value = cMicstasy->channelParameters[channel-1];
+	mutex_unlock(&cMicstasy->lock);
+
+	return known;
+}
+
+
+static void shadow_update(struct micstasy *cMicstasy, int parameterNumber, int8_t value)
+{
+	parameters_update(cMicstasy, parameterNumber, value);
+
+	if(!cMicstasy->shadowEnabled)
+		return;
+
+	mutex_lock(&cMicstasy->lock);
+
+	switch(parameterNumber)
+	{
+		case 0x1C: /* memory recall and a new bank/device ID change everything */
+		case 0x1D:
+			cMicstasy->shadowValid = 0;
+			break;
+
+		default:
+			if(parameterNumber < 0 || parameterNumber >= MICSTASY_REGISTER_COUNT || !(BIT(parameterNumber) & SHADOW_CACHEABLE))
+				break;
+
+			/* a write does not tell the read only bits, so such registers are
+			   only updated while a read has filled them in */
+			if(cMicstasy->shadowValid & BIT(parameterNumber))
+				value = (value & writable_bits(parameterNumber)) | (cMicstasy->shadow[parameterNumber] & ~writable_bits(parameterNumber));
+			else if(writable_bits(parameterNumber) != 0x7F)
+				break;
+
+			cMicstasy->shadow[parameterNumber] = value;
+			cMicstasy->shadowValid |= BIT(parameterNumber);
+	}
+
+	mutex_unlock(&cMicstasy->lock);
+}
+
+
+/* replaces the shadow copy with a complete register dump */
+static void shadow_store(struct micstasy *cMicstasy, const int8_t *registers)
+{
+	int i;
+
+	for(i=1; i<0x18; i+=3)
+		parameters_update(cMicstasy, i, registers[i]);
+
+	if(!cMicstasy->shadowEnabled)
+		return;
+
+	mutex_lock(&cMicstasy->lock);
+	cMicstasy->shadowValid = 0;
+	for(i=0; i<MICSTASY_REGISTER_COUNT; i++)
+	{
+		cMicstasy->shadow[i] = registers[i];
+		if(registers[i] != -1 && (BIT(i) & SHADOW_CACHEABLE))
+			cMicstasy->shadowValid |= BIT(i);
+	}
+	cMicstasy->shadowTime = clock_us();
+	mutex_unlock(&cMicstasy->lock);
+}
+
+
+/* reads the registers in registerMask, from the shadow copy if possible */
+static int read_registers(struct micstasy *cMicstasy, int8_t *registers, uint32_t registerMask)
+{
+	int fresh;
+
+	mutex_lock(&cMicstasy->lock);
+	fresh = shadow_is_fresh(cMicstasy, registerMask) && !(registerMask & ~SHADOW_CACHEABLE);
+	if(fresh)
+		memcpy(registers, cMicstasy->shadow, sizeof(cMicstasy->shadow));
+	mutex_unlock(&cMicstasy->lock);
+
+	if(fresh)
+		return 1;
+
+	if(request_registers(cMicstasy, registers) == -1)
+		return -1;
+
+	shadow_store(cMicstasy, registers);
+
+	return 1;
+}
+
+
+int8_t micstasy_request_value(struct micstasy *cMicstasy, char parameterNumber)
+{
+	int8_t registers[MICSTASY_REGISTER_COUNT];
+
+	if(parameterNumber < 0 || parameterNumber >= MICSTASY_REGISTER_COUNT)
+		return -1;
+
+	if(read_registers(cMicstasy, registers, BIT(parameterNumber)) == -1)
+		return -1;
+
+	return registers[(int)parameterNumber]; /* no error -> MSB: 0 */
+}
+
+
+int micstasy_cache_enable(struct micstasy *cMicstasy, int timeoutMs)
+{
+	if(timeoutMs < 0){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: cache timeout must not be negative (0 = never stale)");
+		return -1;
+	}
+
+	mutex_lock(&cMicstasy->lock);
+	cMicstasy->shadowEnabled = 1;
+	cMicstasy->shadowTimeout = timeoutMs;
+	cMicstasy->shadowValid = 0;
+	mutex_unlock(&cMicstasy->lock);
+
+	return 1;
+}
+
+
+int micstasy_cache_disable(struct micstasy *cMicstasy)
+{
+	mutex_lock(&cMicstasy->lock);
+	cMicstasy->shadowEnabled = 0;
+	cMicstasy->shadowValid = 0;
+	mutex_unlock(&cMicstasy->lock);
+
+	return 1;
+}
+
+
+int micstasy_cache_invalidate(struct micstasy *cMicstasy)
+{
+	mutex_lock(&cMicstasy->lock);
+	cMicstasy->shadowValid = 0;
+	cMicstasy->channelParametersKnown = 0;
+	mutex_unlock(&cMicstasy->lock);
+
+	return 1;
+}
+
+
+int micstasy_cache_refresh(struct micstasy *cMicstasy)
+{
+	int8_t registers[MICSTASY_REGISTER_COUNT];
+
+	if(!cMicstasy->shadowEnabled){
+		error(MICSTASY_ERROR_STATE, "Error: cache not enabled");
+		return -1;
+	}
+
+	micstasy_cache_invalidate(cMicstasy);
+
+	return read_registers(cMicstasy, registers, SHADOW_CACHEABLE);
+}
+
+
+static void decode_levelMeterData(const int8_t *response, int length, struct micstasy_levelMeterData *levelMeterData)
+{
+	int i;
+
+	/* F0 00 20 0D 68 (bank no. / dev ID) 31 (ch.1) (ch.2) (ch.3) (ch.4) (ch.5) (ch.6) (ch.7) (ch.8) F7 */
+	if(length > 15)
+		for(i=0; i<8; i++)
+			if(response[7+i] >= 0 && response[7+i] < 14)
+				levelMeterData->channel[i] = levelMeterLookupTable[(int)response[7+i]];
+			else levelMeterData->channel[i] = 0;
+	else
+		for(i=0; i<8; i++)
+			levelMeterData->channel[i] = 0;
+}
+
+
+int micstasy_get_levelMeterData(struct micstasy *cMicstasy, struct micstasy_levelMeterData *levelMeterData)
+{
+	int8_t *response;
+	int length;
+
+	response = sysex_request(cMicstasy, MESSAGETYPE_REQUEST_LEVELMETER_DATA, &length);
+
+	decode_levelMeterData(response, length, levelMeterData);
+
+	free(response);
+
+
+
+	/*
+	Request Level Meter Data 
+
+		MSB / 7		0
+		6		0
+		5		0
+		4		0
+		3 		MSB / 3 	2
+		1		LSB / 0 	/ 2/ 1
+		0		LSB / 0 	0
+		0
+	
+		Level: 0 	= < -70dBFS peak
+		Level: 1..12 	= < -60 / -50 / -42 / -36 / -30 / -24 /-18 / -12 / -6 / -3 / -1 / -0.1 dBFS
+		Level: 13 	= > -0.1 dBFS (over)
+	*/
+
+	return levelMeterData->channel[0];
+}
+
+
+
+int micstasy_set_value(struct micstasy *cMicstasy, char parameterNumber, char dataByte)
+{
+	struct micstasy_value value;
+
+	value.parameterNumber = parameterNumber;
+	value.value = dataByte;
+
+	return micstasy_set_values(cMicstasy, &value, 1);
+}
+
+
+static int check_values(const struct micstasy_value *values, int count)
+{
+	int i;
+
+	for(i=0; i<count; i++)
+		if(values[i].parameterNumber < 0 || values[i].parameterNumber > 0x1E || values[i].value < 0){
+			error(MICSTASY_ERROR_ARGUMENT, "Error: parameter number (0x00..0x1E) or value (0..127) out of range");
+			return -1;
+		}
+
+	return 1;
+}
+
+
+/* SET_VALUE takes a list of parameter/value pairs, like RESPONSE_VALUE;
+   returns the number of pairs that go into one message, at most maxPairs */
+static int pack_values(int8_t *data, const struct micstasy_value *values, int count, int maxPairs)
+{
+	int n;
+
+	for(n=0; n < maxPairs && n < count; n++)
+	{
+		data[2*n] = values[n].parameterNumber;
+		data[2*n+1] = values[n].value;
+	}
+
+	return n;
+}
+
+
+int micstasy_set_values(struct micstasy *cMicstasy, const struct micstasy_value *values, int count)
+{
+	int8_t data[2*MICSTASY_MAX_SET_PAIRS];
+	int i, j, n;
+
+	if(check_values(values, count) == -1)
+		return -1;
+
+	for(i=0; i<count; i+=n)
+	{
+		n = pack_values(data, values+i, count-i, cMicstasy->bus->setPairs);
+
+		if(sysex_message_send_data(cMicstasy, MESSAGETYPE_SET_VALUE, data, 2*n) == -1)
+			return -1;
+
+		for(j=0; j<n; j++)
+			shadow_update(cMicstasy, values[i+j].parameterNumber, values[i+j].value);
+	}
+
+	return 1;
+}
+
+
+
+static void decode_parameters(int channel, int8_t value, struct micstasy_parameters *parameters)
+{
+	memset(parameters, 0, sizeof(*parameters));
+
+	if(value == -1)
+		return;
+
+	parameters->channel = channel;
+	parameters->gainFine = value & BIT(0);
+	if(channel == 1) {
+		parameters->digitalOutSelect = (value & BIT(1)) >> 1;
+		parameters->autoSetLink = -1;
+		parameters->displayAutoDark = (value & BIT(6)) >> 6;
+	}
+	else {
+		parameters->autoSetLink = (value & BIT(1)) >> 1;
+		parameters->digitalOutSelect = -1;
+		parameters->displayAutoDark = -1;
+	}
+
+	parameters->levelMeter = (value & (BIT(2) | BIT(3) | BIT(4) | BIT(5))) >> 2;
+
+	if(parameters->levelMeter >= 0 && parameters->levelMeter < 14)
+		parameters->levelMeter = levelMeterLookupTable[parameters->levelMeter];
+	else parameters->levelMeter = 0;
+}
+
+
+static void decode_settings(int channel, int8_t value, struct micstasy_settings *settings)
+{
+	memset(settings, -1, sizeof(*settings));
+
+	if(value == -1)
+		return;
+
+	settings->channel = channel;
+	settings->input = value & BIT(0);
+	settings->HiZ = (value & BIT(1))>>1;
+	settings->autoset  = (value & BIT(2))>>2;
+	settings->loCut = (value & BIT(3))>>3;
+
+	if( channel != 1 && channel != 3 && channel != 5 && channel != 7 )
+		settings->MS = -1;
+	else settings->MS = (value & BIT(4))>>4;
+
+	settings->phase = (value & BIT(5))>>5;
+	settings->p48 = (value & BIT(6))>>6;
+}
+
+
+static void decode_setup(int8_t setup1, int8_t setup2, struct micstasy_setup *setup)
+{
+	setup->intFreq = (setup1 & BIT(0));
+	setup->clockRange = (setup1 & (BIT(1) | BIT(2))) >> 1;
+	setup->clockSelect = (setup1 & (BIT(3) | BIT(4))) >> 3;
+	setup->analogOutput = (setup1 & (BIT(5) | BIT(6))) >> 5;
+
+	setup->lockKeys = (setup2 & BIT(0));
+	setup->peakHold = (setup2 & BIT(1))>>1;
+	setup->followClock = (setup2 & BIT(2))>>2;
+	setup->autosetLimit  = (setup2 & (BIT(3) | BIT(4)))>>3;
+	setup->delayCompensation = (setup2 & BIT(5))>>5;
+	setup->autoDevice = (setup2 & BIT(6))>>6;
+}
+
+
+static void decode_locksyncInfo(int8_t value, struct micstasy_locksyncInfo *synclock)
+{
+	memset(synclock, -1, sizeof(*synclock));
+
+	if(value == -1)
+		return;
+
+	synclock->optionLock = (value & BIT(0));
+	synclock->optionSync  = (value & BIT(1))>>1;
+	synclock->aesLock   = (value & BIT(2))>>2;
+	synclock->aesSync = (value & BIT(3))>>3;
+	synclock->wckLock   = (value & BIT(4))>>4;
+	synclock->wckSync = (value & BIT(5))>>5;
+	synclock->wcOut = (value & BIT(6))>>6;
+}
+
+
+static int8_t encode_gainCoarse(int dbValue)
+{
+	if(dbValue < -9 || dbValue > 76){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: dB Value out of range (-9..76 dB)");
+		return -1;
+	}
+
+	return dbValue+9;
+}
+
+
+static int8_t encode_parameters(int channel, boolean gainFine, boolean displayAutoDark, boolean autoSetLink, boolean digitalOutSelect)
+{
+	int8_t value = 0;
+
+	if(displayAutoDark != -1 && channel != 1){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: Display auto dark only available on channel 1");
+		return -1;
+	}
+	if(autoSetLink != -1 && channel == 1){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: AutoSet link only available on channel 2..8");
+		return -1;	
+	}
+	if(digitalOutSelect != -1 && channel != 1){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: digital out selection only available on channel 1");
+		return -1;	
+	}
+
+	if(displayAutoDark == 1)	/* 0=off, 1=on */
+		value |= (1<<6);
+
+	if(gainFine == 1)		/* 0=0dB, 1=+0.5db */
+		value |= (1<<0);
+
+	/* AutoSet Link: 0 = off, 1 = link to lower channel
+	  channel 1: digital out AES/ADAT 0 = analog, 1 = Option */
+	if(autoSetLink == 1 || digitalOutSelect == 1) 						
+		value |= (1<<1);
+
+	return value;
+}
+
+
+static int8_t encode_settings(int channel, boolean input, boolean HiZ, boolean autoset, boolean loCut, boolean MS, boolean phase, boolean p48)
+{
+	int8_t value = 0;
+
+	if(MS != -1 && (channel != 1 && channel != 3 && channel != 5 && channel != 7) ){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: M/S only available on channel 1,3,5,7");
+		return -1;
+	}	
+
+	if(input == 1)		/* Input: 0 = rear, 1 = front */
+		value |= (1<<0);
+	if(HiZ == 1)		/* Hi Z: 0 = off, 1 = on */
+		value |= (1<<1);
+	if(autoset == 1)	/* Autoset: 0 = off, 1 = on */
+		value |= (1<<2);
+	if(loCut == 1)		/* Lo Cut: 0 = off, 1 = on */
+		value |= (1<<3);
+	if(MS == 1)		/* M/S: 0 = off, 1 = on (set only ch. 1, 3, 5,7) */
+		value |= (1<<4);
+	if(phase == 1)		/* Phase: 0 = normal, 1 = inverted */
+		value |= (1<<5);
+	if(p48 == 1)		/* P48: 0 = off, 1 = on */
+		value |= (1<<6);
+
+	return value;
+}
+
+
+/* fills setup 1 (0x18) and setup 2 (0x19) */
+static int encode_setup(boolean intFreq, int clockRange, int clockSelect, int analogOutput, boolean lockKeys, boolean peakHold,
+	 boolean followClock, int autosetLimit, boolean delayCompensation, boolean autoDevice, int8_t *setup1, int8_t *setup2)
+{
+	int8_t value;
+
+	if(clockRange < 0 || clockRange > 2){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: clock range out of range 0..2");
+		return -1;
+	}	
+	if(clockSelect < 0 || clockSelect > 3){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: clock select out of range 0..3");
+		return -1;
+	}
+	if(analogOutput < 0 || analogOutput > 2){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: analog output out of range 0..2");
+		return -1;
+	}	
+	if(autosetLimit < 0 || autosetLimit > 3){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: autoset limit out of range 0..3");
+		return -1;
+	}	
+
+	value = 0;
+
+	if(intFreq == 1)
+		value |= (1<<0); /* int. freq.: 0 = 44.1kHz, 1 = 48kHz (don't care for clock sel > 0) */
+	
+	value |= (clockRange << 1); /* clock range: 0 = single speed, 1 = ds, 2= qs */
+	value |= (clockSelect << 3); /* clock select: 0 = int., 1 = Option, 2 = AES, 3 = WCK */
+	value |= (analogOutput << 5); /* analog output: 0 = +13dBu, 1 =+19dBu, 2 = +24dBu */
+
+	*setup1 = value;
+	value = 0;
+
+	if(lockKeys == 1)
+		value |= (1<<0); /* Lock Keys: 0 = unlock, 1 = lock */
+	if(peakHold == 1)
+		value |= (1<<1); /* Peak Hold: 0 = off, 1 = on */
+	if(followClock == 1)
+		value |= (1<<2); /* Follow Clock: 0 = off, 1 = on */
+
+	value |= (autosetLimit << 3); /* Autoset-Limit: 0 = -1dB, 1 = -3dB, 2 = -6dB, 3 = -12dB */
+
+	if(delayCompensation == 1)
+		value |= (1<<5); /* Delay Compensation: 0 = off, 1 = on */
+	if(autoDevice == 1)
+		value |= (1<<6); /* Auto-Device: 0 = off, 1 = on */
+
+	*setup2 = value;
+
+	return 1;
+}
+
+
+int micstasy_set_gainCoarse(struct micstasy *cMicstasy, int channel, int dbValue)
+{
+	char value, ret;
+	int parameterNumber;
+
+	if(channel < 1 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (1..8)");
+		return -1;
+	}
+	
+	value = encode_gainCoarse(dbValue);
+	if(value == -1) return -1;
+
+	parameterNumber = (channel-1)*3;
+
+
+	ret = micstasy_set_value(cMicstasy, parameterNumber, value);
+
+
+	return ret;
+}
+
+int micstasy_get_gainCoarse(struct micstasy *cMicstasy, int channel)
+{
+
+	int dbValue;
+	int parameterNumber;
+
+	if(channel < 1 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (1..8)");
+		return -1;
+	}
+
+	parameterNumber = (channel-1)*3;
+
+	dbValue = micstasy_request_value(cMicstasy, parameterNumber);
+
+	if(dbValue != -1) dbValue = dbValue-9;
+	
+	return dbValue;
+}
+
+
+double micstasy_get_gain(struct micstasy *cMicstasy, int channel, double *dbValue)
+{
+	int8_t registers[MICSTASY_REGISTER_COUNT];
+	int gainRegister, parameterRegister;
+
+	if(channel < 1 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (1..8)");
+		return -1;
+	}
+
+	gainRegister = (channel-1)*3;
+	parameterRegister = gainRegister+1;
+
+	/* coarse gain and the fine gain bit come with one register dump */
+	if(read_registers(cMicstasy, registers, BIT(gainRegister) | BIT(parameterRegister)) == -1)
+		return -1;
+
+	if(registers[gainRegister] == -1 || registers[parameterRegister] == -1)
+		return error(MICSTASY_ERROR_RESPONSE, "Error: gain registers missing from the response");
+
+	*dbValue = registers[gainRegister]-9;
+	if(registers[parameterRegister] & BIT(0)) *dbValue += 0.5;
+
+	return registers[parameterRegister];
+}
+
+
+int micstasy_get_parameters(struct micstasy *cMicstasy, int channel, struct micstasy_parameters *parameters)
+{
+	char value;
+	int parameterNumber;
+
+	if(channel < 1 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (1..8)");
+		return -1;
+	}
+
+	parameterNumber = (channel-1)*3+1;
+
+	value = micstasy_request_value(cMicstasy, parameterNumber);
+
+	decode_parameters(channel, value, parameters);
+
+	return value;
+}
+
+int micstasy_get_settings(struct micstasy *cMicstasy, int channel, struct micstasy_settings *settings)
+{
+	char value;
+	int parameterNumber;
+
+	if(channel < 1 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (1..8)");
+		return -1;
+	}
+
+	parameterNumber = (channel-1)*3+2;
+
+	value = micstasy_request_value(cMicstasy, parameterNumber);
+
+	decode_settings(channel, value, settings);
+
+	return value;
+}
+
+
+int micstasy_set_parameters(struct micstasy *cMicstasy, int channel, boolean gainFine, boolean displayAutoDark, boolean autoSetLink, boolean digitalOutSelect)
+{
+	int parameterNumber;
+	char value, ret;
+
+	if(channel < 1 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (1..8)");
+		return -1;
+	}
+
+	value = encode_parameters(channel, gainFine, displayAutoDark, autoSetLink, digitalOutSelect);
+	if(value == -1) return -1;
+
+	parameterNumber = (channel-1)*3+1;
+
+	ret = micstasy_set_value(cMicstasy, parameterNumber, value);
+
+	return ret;
+}
+
+
+int micstasy_set_settings(struct micstasy *cMicstasy, int channel,
+		 boolean input, boolean HiZ, boolean autoset, boolean loCut, boolean MS, boolean phase, boolean p48)
+{
+
+	int ret, parameterNumber;
+	char value;
+
+	if(channel < 1 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (1..8)");
+		return -1;
+	}
+
+	value = encode_settings(channel, input, HiZ, autoset, loCut, MS, phase, p48);
+	if(value == -1) return -1;
+
+	parameterNumber = (channel-1)*3+2;	
+
+	ret = micstasy_set_value(cMicstasy, parameterNumber, value);
+
+	return ret;
+}
+
+
+int micstasy_setup(struct micstasy *cMicstasy, boolean intFreq, int clockRange, int clockSelect,
+	 int analogOutput, boolean lockKeys, boolean peakHold, boolean followClock, int autosetLimit, boolean delayCompensation, boolean autoDevice)
+{
+	struct micstasy_value values[2];
+
+	values[0].parameterNumber = 0x18; /* setup 1 */
+	values[1].parameterNumber = 0x19; /* setup 2 */
+
+	if(encode_setup(intFreq, clockRange, clockSelect, analogOutput, lockKeys, peakHold, followClock,
+			 autosetLimit, delayCompensation, autoDevice, &values[0].value, &values[1].value) == -1)
+		return -1;
+
+	return micstasy_set_values(cMicstasy, values, 2);
+}
+
+
+int micstasy_get_setup(struct micstasy *cMicstasy, struct micstasy_setup *setup)
+{
+	int8_t registers[MICSTASY_REGISTER_COUNT];
+
+	/* setup 1 and 2 are part of the same response */
+	if(read_registers(cMicstasy, registers, BIT(0x18) | BIT(0x19)) == -1) return -1;
+	if(registers[0x18] == -1 || registers[0x19] == -1)
+		return error(MICSTASY_ERROR_RESPONSE, "Error: incomplete response from micstasy");
+
+	decode_setup(registers[0x18], registers[0x19], setup);
+
+	return 1;
+}
+
+
+
+int micstasy_get_locksyncInfo(struct micstasy *cMicstasy, struct micstasy_locksyncInfo *synclock)
+{
+	char parameterNumber = 0x1A;
+	char value;
+
+
+	value = micstasy_request_value(cMicstasy, parameterNumber);
+
+	decode_locksyncInfo(value, synclock);
+/*
+	MSB / 7		0
+	6		WC Out: 0 = Fs, 1 = Single Speed
+	5		WCK Sync: 0 = no sync, 1 = sync
+	4		WCK Lock: 0 = unlock, 1 = lock
+	3		AES Sync: 0 = no sync, 1 = sync
+	2		AES Lock: 0 = unlock, 1 = lock
+	1		Option Sync: 0 = no sync, 1 = sync
+	LSB / 0 	Option Lock: 0 = unlock, 1 = lock 
+*/
+	
+
+	return value;
+}
+
+
+static int decode_state(const int8_t *registers, struct micstasy_state *state)
+{
+	int channel, i;
+
+	for(i=0; i<MICSTASY_REGISTER_COUNT; i++)
+		if(registers[i] == -1)
+			return error(MICSTASY_ERROR_RESPONSE, "Error: incomplete response from micstasy");
+
+	for(channel=1; channel <= 8; channel++) {
+		state->gainCoarse[channel-1] = registers[(channel-1)*3]-9;
+		decode_parameters(channel, registers[(channel-1)*3+1], &state->parameters[channel-1]);
+		decode_settings(channel, registers[(channel-1)*3+2], &state->settings[channel-1]);
+	}
+
+	decode_setup(registers[0x18], registers[0x19], &state->setup);
+	decode_locksyncInfo(registers[0x1A], &state->locksyncInfo);
+
+	return 1;
+}
+
+
+int micstasy_get_state(struct micstasy *cMicstasy, struct micstasy_state *state)
+{
+	int8_t registers[MICSTASY_REGISTER_COUNT];
+
+	/* a single REQUEST_VALUE returns all parameter/value pairs at once */
+	if(read_registers(cMicstasy, registers, BIT(MICSTASY_REGISTER_COUNT)-1) == -1) return -1;
+
+	return decode_state(registers, state);
+}
+
+
+/* matches a reply to the oldest outstanding request of the same type and unit */
+static int pipeline_find(struct micstasy_request *requests, int sent, const int8_t *reply)
+{
+	int i;
+	int8_t address;
+
+	for(i=0; i<sent; i++)
+	{
+		if(requests[i].status != 0 || reply[6] != requests[i].messageType+0x20)
+			continue;
+
+		address = (requests[i].bankNumber<<4) | requests[i].deviceID;
+		if(reply[5] == address || address == ADDRESS_BROADCAST)
+			return i;
+	}
+
+	return -1;
+}
+
+
+struct pipeline_context {
+	struct micstasy_request *requests;
+	int sent;
+	PmTimestamp since;	/* replies received before are stale */
+};
+
+
+static int pipeline_match(const struct micstasy_sysex *reply, void *context)
+{
+	struct pipeline_context *pipeline = (struct pipeline_context *)context;
+
+	if(pipeline_find(pipeline->requests, pipeline->sent, reply->data) == -1)
+		return 0;
+
+	return TIME_BEFORE(reply->timestamp, pipeline->since) ? REPLY_STALE : 1;
+}
+
+
+int micstasy_pipeline(struct micstasy *cMicstasy, struct micstasy_request *requests, int count, int window)
+{
+	int8_t registers[MICSTASY_REGISTER_COUNT];
+	int8_t *reply;
+	int length, i;
+	int sent = 0, answered = 0, inflight = 0;
+	uint64_t deadline, start;
+	struct pipeline_context context;
+
+	if(window < 1){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: pipeline window must be at least 1");
+		return -1;
+	}
+
+	for(i=0; i<count; i++)
+	{
+		if(requests[i].messageType != MESSAGETYPE_REQUEST_VALUE && requests[i].messageType != MESSAGETYPE_REQUEST_LEVELMETER_DATA){
+			error(MICSTASY_ERROR_ARGUMENT, "Error: only value and level meter requests can be pipelined");
+			return -1;
+		}
+		requests[i].status = 0;
+	}
+
+	context.requests = requests;
+	context.sent = 0;
+	context.since = bus_time(NULL);
+	start = clock_us();
+
+	while(answered < count)
+	{
+		/* keep up to window requests on the link */
+		while(inflight < window && sent < count)
+		{
+			if(sysex_write(cMicstasy->bus, (requests[sent].bankNumber<<4) | requests[sent].deviceID, requests[sent].messageType, NULL, 0) == -1)
+				requests[sent].status = -1;
+			else
+				inflight++;
+			context.sent = ++sent;
+		}
+
+		if(inflight == 0)
+			break;
+
+		deadline = clock_us() + (uint64_t)cMicstasy->timeout*1000;
+		reply = bus_wait(cMicstasy->bus, pipeline_match, &context, deadline, &length);
+
+		if(reply == NULL)
+		{
+			/* the link stalled, give up on everything not answered yet */
+			for(i=0; i<count; i++)
+				if(requests[i].status == 0)
+					requests[i].status = -1;
+			stats_count(cMicstasy->bus, &cMicstasy->bus->stats.timeouts, 1);
+			error(MICSTASY_ERROR_TIMEOUT, "no response from micstasy");
+			break;
+		}
+
+		i = pipeline_find(requests, sent, reply);
+		if(i != -1)
+		{
+			if(reply[6] == MESSAGETYPE_RESPONSE_VALUE)
+			{
+				parse_registers(reply, length, registers);
+				requests[i].status = decode_state(registers, &requests[i].state) == -1 ? -1 : 1;
+
+				if(reply[5] == ((cMicstasy->bankNumber<<4) | cMicstasy->deviceID))
+					shadow_store(cMicstasy, registers);
+			}
+			else
+			{
+				decode_levelMeterData(reply, length, &requests[i].levelMeterData);
+				requests[i].status = 1;
+			}
+
+			if(requests[i].status == 1)
+				answered++;
+			inflight--;
+		}
+
+		free(reply);
+	}
+
+	stats_latency(cMicstasy->bus, MICSTASY_STAT_PIPELINE, start);
+
+	return answered;
+}
+
+
+int micstasy_set_bankdevID(struct micstasy *cMicstasy, int8_t bankID, int8_t devID)
+{
+
+	int ret;
+	int8_t bankdevID, parameterNumber = 0x1D;
+
+	bankdevID = (bankID<<4) | devID;
+
+	if( (bankdevID < 0x00 || bankdevID > 0x77) && bankdevID != ADDRESS_BROADCAST){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: bankdevID out of range 0x00..0x77, 0x7F");
+		return -1;
+	}
+
+	ret = micstasy_set_value(cMicstasy, parameterNumber, bankdevID);
+
+	return ret;
+}
+
+
+int micstasy_set_oscillator(struct micstasy *cMicstasy, int channel)
+{
+	int ret;
+	char parameterNumber = 0x1E;
+
+	if(channel < 0 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (0=off,1..8)");
+		return -1;
+	}
+
+	/* Oscillator: 0 = off, 1..8 = Channel 1..8 */
+	ret = micstasy_set_value(cMicstasy, parameterNumber, channel);
+	
+	return ret;
+}
+
+int micstasy_memory_save(struct micstasy *cMicstasy, int slot)
+{
+	int ret;
+	char parameterNumber = 0x1B;
+
+	if(slot < 0 || slot > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: slot out of range (0=idle, 1..8)");
+		return -1;
+	}
+
+	/* 0 = idle, 1..8 save memory 1..8 */
+	ret = micstasy_set_value(cMicstasy, parameterNumber, slot);
+	
+	return ret;
+}
+
+int micstasy_memory_recall(struct micstasy *cMicstasy, int slot)
+{
+	int ret;
+	char parameterNumber = 0x1C;
+
+	if(slot < 0 || slot > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: slot out of range (0=idle, 1..8)");
+		return -1;
+	}
+
+	/* 0 = idle, 1..8 recall memory 1..8 */
+	ret = micstasy_set_value(cMicstasy, parameterNumber, slot);
+	
+	return ret;
+}
+
+
+int micstasy_store_state(struct micstasy *cMicstasy, char *filePath)
+{
+	struct micstasy_state state;
+	struct micstasy_parameters *parameters;
+	struct micstasy_settings *settings;
+	struct micstasy_setup *setup = &state.setup;
+	int channel;
+	FILE *stateFile;
+
+
+	if(micstasy_get_state(cMicstasy, &state) == -1)
+		return -1;
+
+	stateFile = fopen(filePath, "w");
+	if(stateFile == NULL) {
+		error(MICSTASY_ERROR_FILE, "ERROR: unable to open file");
+		return -1;
+	}
+
+	for(channel=1; channel <= 8; channel++) {
+		parameters = &state.parameters[channel-1];
+		settings = &state.settings[channel-1];
+
+		fprintf(stateFile, "%d \n", state.gainCoarse[channel-1]);
+		fprintf(stateFile, "%d %d %d %d \n", parameters->gainFine, parameters->digitalOutSelect, parameters->autoSetLink, parameters->displayAutoDark);
+		fprintf(stateFile, "%d %d %d %d %d %d \n", settings->input, settings->HiZ, settings->loCut, settings->MS, settings->phase, settings->p48);
+
+
+		if(DEBUG) {
+			printf("channel: %d\n", channel);
+			printf("gainCoarse: %d\n\n", state.gainCoarse[channel-1]);
+			printf("gainFine: %d\n digitalOutSelect: %d\nautoSetLink: %d\n displayAutoDark: %d\n\n", parameters->gainFine, parameters->digitalOutSelect, parameters->autoSetLink, parameters->displayAutoDark);
+			printf("input: %d\n HiZ: %d\n loCut: %d\n MS: %d\n Phase: %d\n p48: %d\n\n", settings->input, settings->HiZ, settings->loCut, settings->MS, settings->phase, settings->p48);
+
+		}
+
+	}
+
+	fprintf(stateFile, "%d %d %d %d %d %d %d %d %d %d \n",
+	setup->intFreq, setup->clockRange, setup->clockSelect, setup->analogOutput, setup->lockKeys, setup->peakHold, setup->followClock, setup->autosetLimit, setup->delayCompensation, setup->autoDevice);
+
+	fclose(stateFile);
+
+	return 1;
+}
+
+/* reads a micstasy_store_state() file into the registers of channel 1..8 and setup 1/2 */
+static int load_state_file(char *filePath, int8_t *registers)
+{
+	FILE *stateFile;
+	int gainCoarse;
+	int gainFine, digitalOutSelect, autoSetLink, displayAutoDark;
+	int channel, input, HiZ, loCut, MS, phase, p48;
+	int intFreq, clockRange, clockSelect, analogOutput, lockKeys, peakHold, followClock, autosetLimit, delayCompensation, autoDevice;
+	int ret = 1;
+
+
+	stateFile = fopen(filePath, "r");
+	if(stateFile == NULL) {
+		error(MICSTASY_ERROR_FILE, "ERROR: unable to open file");
+		return -1;
+	}
+
+	for(channel=1; channel <= 8 && ret != -1; channel++) {
+
+		if(fscanf(stateFile, "%d \n", &gainCoarse) != 1 ||
+		   fscanf(stateFile, "%d %d %d %d \n", &gainFine, &digitalOutSelect, &autoSetLink, &displayAutoDark) != 4 ||
+		   fscanf(stateFile, "%d %d %d %d %d %d \n", &input, &HiZ, &loCut, &MS, &phase, &p48) != 6) {
+			ret = error(MICSTASY_ERROR_FILE, "ERROR: invalid state file");
+			break;
+		}
+
+		/* autoset is not part of the state file and restored as off */
+		registers[(channel-1)*3] = encode_gainCoarse(gainCoarse);
+		registers[(channel-1)*3+1] = encode_parameters(channel, gainFine, displayAutoDark, autoSetLink, digitalOutSelect);
+		registers[(channel-1)*3+2] = encode_settings(channel, input, HiZ, 0, loCut, MS, phase, p48);
+
+		if(registers[(channel-1)*3] == -1 || registers[(channel-1)*3+1] == -1 || registers[(channel-1)*3+2] == -1)
+			ret = -1;
+
+		if(DEBUG) {
+			printf("channel: %d\n", channel);
+			printf("gainCoarse: %d\n\n", gainCoarse);
+			printf("gainFine: %d\n digitalOutSelect: %d\nautoSetLink: %d\n displayAutoDark: %d\n\n", gainFine, digitalOutSelect, autoSetLink, displayAutoDark);
+			printf("input: %d\n HiZ: %d\n loCut: %d\n MS: %d\n Phase: %d\n p48: %d\n\n", input, HiZ, loCut, MS, phase, p48);
+
+		}
+
+	}
+
+	if(ret != -1) {
+		if(fscanf(stateFile, "%d %d %d %d %d %d %d %d %d %d \n",
+		   &intFreq, &clockRange, &clockSelect, &analogOutput, &lockKeys, &peakHold, &followClock, &autosetLimit, &delayCompensation, &autoDevice) != 10)
+			ret = error(MICSTASY_ERROR_FILE, "ERROR: invalid state file");
+		else
+			ret = encode_setup(intFreq, clockRange, clockSelect, analogOutput, lockKeys, peakHold, followClock,
+				 autosetLimit, delayCompensation, autoDevice, &registers[0x18], &registers[0x19]);
+	}
+
+	fclose(stateFile);
+
+	return ret;
+}
+
+
+int micstasy_restore_state(struct micstasy *cMicstasy, char *filePath)
+{
+	int8_t registers[MICSTASY_REGISTER_COUNT];
+	struct micstasy_value values[0x1A+1];
+	int i;
+
+	if(load_state_file(filePath, registers) == -1)
+		return -1;
+
+	/* set_values() splits the pairs into messages of set_max_pairs() pairs each */
+	values[0].parameterNumber = 0x1E;  /* disable oscillator by default, before the gains */
+	values[0].value = 0;
+
+	for(i=0; i<0x1A; i++) {
+		values[i+1].parameterNumber = i;
+		values[i+1].value = registers[i];
+	}
+
+	return micstasy_set_values(cMicstasy, values, 0x1A+1);
+}
+
+/* writes registers 0x00..0x19, only those that differ from the unit if delta is set */
+static int apply_registers(struct micstasy *cMicstasy, int8_t *target, boolean delta, boolean keepAutoset, boolean verify)
+{
+	int8_t current[MICSTASY_REGISTER_COUNT];
+	struct micstasy_value values[MICSTASY_SCENE_REGISTERS];
+	int i, count = 0;
+
+	if((delta || keepAutoset) && read_registers(cMicstasy, current, BIT(MICSTASY_SCENE_REGISTERS)-1) == -1)
+		return -1;
+
+	for(i=0; i<MICSTASY_SCENE_REGISTERS; i++) {
+		if(keepAutoset && i < 0x18 && i%3 == 2)
+			target[i] = (target[i] & ~BIT(2)) | (current[i] & BIT(2));
+
+		if(!delta || (target[i] & writable_bits(i)) != (current[i] & writable_bits(i))) {
+			values[count].parameterNumber = i;
+			values[count].value = target[i] & writable_bits(i);
+			count++;
+		}
+	}
+
+	if(count > 0 && micstasy_set_values(cMicstasy, values, count) == -1)
+		return -1;
+
+	if(verify) {
+		/* read back from the unit itself, not from the shadow copy */
+		if(request_registers(cMicstasy, current) == -1)
+			return -1;
+		shadow_store(cMicstasy, current);
+
+		for(i=0; i<MICSTASY_SCENE_REGISTERS; i++)
+			if((target[i] & writable_bits(i)) != (current[i] & writable_bits(i)))
+				return error(MICSTASY_ERROR_RESPONSE, "Error: restored state does not match the unit");
+	}
+
+	return count;
+}
+
+
+int micstasy_restore_state_delta(struct micstasy *cMicstasy, char *filePath, boolean verify)
+{
+	int8_t target[MICSTASY_REGISTER_COUNT];
+
+	if(load_state_file(filePath, target) == -1)
+		return -1;
+
+	/* autoset is not part of the state file, keep what the unit has */
+	return apply_registers(cMicstasy, target, 1, 1, verify);
+}
+
+
+/* binary scene library */
+
+static uint32_t read_le32(const uint8_t *bytes)
+{
+	return bytes[0] | (bytes[1]<<8) | (bytes[2]<<16) | ((uint32_t)bytes[3]<<24);
+}
+
+
+static void write_le32(uint8_t *bytes, uint32_t value)
+{
+	bytes[0] = value & 0xFF;
+	bytes[1] = (value>>8) & 0xFF;
+	bytes[2] = (value>>16) & 0xFF;
+	bytes[3] = (value>>24) & 0xFF;
+}
+
+
+int micstasy_scene_capture(struct micstasy *cMicstasy, struct micstasy_scene *scene)
+{
+	int8_t registers[MICSTASY_REGISTER_COUNT];
+	uint8_t address = (cMicstasy->bankNumber<<4) | cMicstasy->deviceID;
+	int i;
+
+	if(read_registers(cMicstasy, registers, BIT(MICSTASY_SCENE_REGISTERS)-1) == -1)
+		return -1;
+
+	/* a register missing from the reply would be applied as 0x7F later */
+	for(i=0; i<MICSTASY_SCENE_REGISTERS; i++)
+		if(registers[i] == -1)
+			return error(MICSTASY_ERROR_RESPONSE, "Error: scene registers missing from the response");
+
+	/* replace this unit's record or add a new one */
+	for(i=0; i<scene->unitCount && scene->units[i].address != address; i++);
+
+	if(i == MICSTASY_SCENE_MAX_UNITS){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: too many units in scene");
+		return -1;
+	}
+	if(i == scene->unitCount)
+		scene->unitCount++;
+
+	scene->units[i].address = address;
+	memcpy(scene->units[i].registers, registers, MICSTASY_SCENE_REGISTERS);
+
+	return 1;
+}
+
+
+/* index of the scene record for the unit, or -1 */
+static int scene_find_unit(struct micstasy *cMicstasy, const struct micstasy_scene *scene)
+{
+	uint8_t address = (cMicstasy->bankNumber<<4) | cMicstasy->deviceID;
+	int i;
+
+	for(i=0; i<scene->unitCount && scene->units[i].address != address; i++);
+
+	/* a single unit scene applies to whatever unit it is recalled on */
+	if(i == scene->unitCount && scene->unitCount == 1)
+		i = 0;
+
+	if(i == scene->unitCount){
+		error(MICSTASY_ERROR_NOT_FOUND, "Error: scene has no record for this unit");
+		return -1;
+	}
+
+	return i;
+}
+
+
+int micstasy_scene_apply(struct micstasy *cMicstasy, const struct micstasy_scene *scene, boolean delta)
+{
+	int8_t target[MICSTASY_REGISTER_COUNT];
+	int i;
+
+	if((i = scene_find_unit(cMicstasy, scene)) == -1)
+		return -1;
+
+	memcpy(target, scene->units[i].registers, MICSTASY_SCENE_REGISTERS);
+
+	return apply_registers(cMicstasy, target, delta, 0, 0);
+}
+
+
+/* adds the scene to the file, replacing a scene of the same name */
+int micstasy_scenes_save(char *filePath, const struct micstasy_scene *scene)
+{
+	struct micstasy_sceneFileHeader header;
+	char name[MICSTASY_SCENE_NAME_LENGTH];
+	uint32_t index, sceneCount;
+	FILE *sceneFile;
+
+	sceneFile = fopen(filePath, "r+b");
+	if(sceneFile == NULL) {
+		sceneFile = fopen(filePath, "w+b");
+		if(sceneFile == NULL) {
+			error(MICSTASY_ERROR_FILE, "ERROR: unable to open file");
+			return -1;
+		}
+
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, MICSTASY_SCENE_MAGIC, 4);
+		header.version = MICSTASY_SCENE_VERSION;
+		header.sceneSize[0] = sizeof(struct micstasy_scene) & 0xFF;
+		header.sceneSize[1] = sizeof(struct micstasy_scene) >> 8;
+	}
+	else if(fread(&header, sizeof(header), 1, sceneFile) != 1 || memcmp(header.magic, MICSTASY_SCENE_MAGIC, 4) != 0 ||
+		header.version != MICSTASY_SCENE_VERSION || (header.sceneSize[0] | (header.sceneSize[1]<<8)) != sizeof(struct micstasy_scene)) {
+		fclose(sceneFile);
+		error(MICSTASY_ERROR_FILE, "ERROR: not a micstasy scene file of this version");
+		return -1;
+	}
+
+	sceneCount = read_le32(header.sceneCount);
+
+	for(index=0; index<sceneCount; index++) {
+		if(fseek(sceneFile, sizeof(header) + index*sizeof(struct micstasy_scene), SEEK_SET) != 0 ||
+		   fread(name, sizeof(name), 1, sceneFile) != 1)
+			break;
+		if(strncmp(name, scene->name, MICSTASY_SCENE_NAME_LENGTH) == 0)
+			break;
+	}
+
+	if(index == sceneCount)
+		write_le32(header.sceneCount, sceneCount+1);
+
+	if(fseek(sceneFile, sizeof(header) + index*sizeof(struct micstasy_scene), SEEK_SET) != 0 ||
+	   fwrite(scene, sizeof(struct micstasy_scene), 1, sceneFile) != 1 ||
+	   fseek(sceneFile, 0, SEEK_SET) != 0 ||
+	   fwrite(&header, sizeof(header), 1, sceneFile) != 1) {
+		fclose(sceneFile);
+		error(MICSTASY_ERROR_FILE, "ERROR: unable to write file");
+		return -1;
+	}
+
+	fclose(sceneFile);
+
+	return index;
+}
+
+
+struct micstasy_sceneLibrary *micstasy_scenes_open(char *filePath)
+{
+	struct micstasy_sceneLibrary *library;
+	const struct micstasy_sceneFileHeader *header;
+	void *data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file, mapping;
+	LARGE_INTEGER fileSize;
+
+	file = CreateFileA(filePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE) {
+		error(MICSTASY_ERROR_FILE, "ERROR: unable to open file");
+		return NULL;
+	}
+
+	GetFileSizeEx(file, &fileSize);
+	size = (size_t)fileSize.QuadPart;
+
+	mapping = size > 0 ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	data = mapping != NULL ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+
+	/* the view stays valid after both handles are closed */
+	if(mapping != NULL) CloseHandle(mapping);
+	CloseHandle(file);
+
+	if(data == NULL) {
+		error(MICSTASY_ERROR_FILE, "ERROR: unable to map file");
+		return NULL;
+	}
+#else
+	int fd;
+	struct stat fileStat;
+
+	fd = open(filePath, O_RDONLY);
+	if(fd == -1) {
+		error(MICSTASY_ERROR_FILE, "ERROR: unable to open file");
+		return NULL;
+	}
+
+	if(fstat(fd, &fileStat) == -1 || fileStat.st_size == 0) {
+		close(fd);
+		error(MICSTASY_ERROR_FILE, "ERROR: unable to map file");
+		return NULL;
+	}
+
+	size = fileStat.st_size;
+	data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(data == MAP_FAILED) {
+		error(MICSTASY_ERROR_FILE, "ERROR: unable to map file");
+		return NULL;
+	}
+#endif
+
+	library = (struct micstasy_sceneLibrary *) malloc(sizeof(struct micstasy_sceneLibrary));
+	if(library == NULL) {
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap(data, size);
+#endif
+		error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+		return NULL;
+	}
+	library->data = (const uint8_t *)data;
+	library->size = size;
+
+	header = (const struct micstasy_sceneFileHeader *)data;
+
+	if(size < sizeof(*header) || memcmp(header->magic, MICSTASY_SCENE_MAGIC, 4) != 0 || header->version != MICSTASY_SCENE_VERSION ||
+	   (header->sceneSize[0] | (header->sceneSize[1]<<8)) != sizeof(struct micstasy_scene) ||
+	   size < sizeof(*header) + read_le32(header->sceneCount)*sizeof(struct micstasy_scene)) {
+		micstasy_scenes_close(library);
+		error(MICSTASY_ERROR_FILE, "ERROR: not a micstasy scene file of this version");
+		return NULL;
+	}
+
+	library->sceneCount = read_le32(header->sceneCount);
+
+	return library;
+}
+
+
+const struct micstasy_scene *micstasy_scenes_get(struct micstasy_sceneLibrary *library, int index)
+{
+	if(index < 0 || index >= library->sceneCount){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: scene index out of range");
+		return NULL;
+	}
+
+	return (const struct micstasy_scene *)(library->data + sizeof(struct micstasy_sceneFileHeader) + index*sizeof(struct micstasy_scene));
+}
+
+
+int micstasy_scenes_find(struct micstasy_sceneLibrary *library, const char *name)
+{
+	int i;
+
+	for(i=0; i<library->sceneCount; i++)
+		if(strncmp(micstasy_scenes_get(library, i)->name, name, MICSTASY_SCENE_NAME_LENGTH) == 0)
+			return i;
+
+	error(MICSTASY_ERROR_NOT_FOUND, "Error: scene not found");
+
+	return -1;
+}
+
+
+int micstasy_scenes_close(struct micstasy_sceneLibrary *library)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(library->data);
+#else
+	munmap((void *)library->data, library->size);
+#endif
+	free(library);
+
+	return 1;
+}
+
+
+/* rounds to the 0.5 dB grid of coarse gain plus gain fine */
+static void split_gain(double dbValue, int *dbCoarse, boolean *gainFine)
+{
+	if( dbValue-(int)dbValue >= 0.75) {
+		*dbCoarse = (int)dbValue+1;
+		*gainFine = 0;
+	}
+	else if( dbValue-(int)dbValue < 0.25) {
+		*dbCoarse = (int)dbValue;
+		*gainFine = 0;
+	}
+	else {
+		
+		*dbCoarse = (int)dbValue;
+		*gainFine = 1;
+	}
+}
+
+
+int micstasy_set_gain(struct micstasy *cMicstasy, int channel, double dbValue)
+{
+	boolean gainFine;
+	int dbCoarse;
+	int8_t parameters, registers[MICSTASY_REGISTER_COUNT];
+	int parameterNumber = (channel-1)*3+1;
+	struct micstasy_value values[2];
+
+	if(channel < 1 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (1..8)");
+		return -1;
+	}
+
+	split_gain(dbValue, &dbCoarse, &gainFine);
+
+	values[0].parameterNumber = (channel-1)*3;
+	values[0].value = encode_gainCoarse(dbCoarse);
+	if(values[0].value == -1) return -1;
+
+	/* the other bits of the parameters register are kept, read only
+	   when no copy of them is known yet */
+	if(!parameters_known(cMicstasy, channel, &parameters)) {
+		if(read_registers(cMicstasy, registers, BIT(parameterNumber)) == -1) return -1;
+		parameters = registers[parameterNumber] & writable_bits(parameterNumber);
+	}
+
+	if((parameters & BIT(0)) == (gainFine == 1 ? BIT(0) : 0))
+		return micstasy_set_values(cMicstasy, values, 1);
+
+	values[1].parameterNumber = parameterNumber;
+	values[1].value = (parameters & ~BIT(0)) | (gainFine == 1 ? BIT(0) : 0);
+
+	/* coarse and fine gain in one message, if the bus takes two pairs */
+	return micstasy_set_values(cMicstasy, values, 2);
+}
+
+
+/* group operations: one broadcast SET_VALUE reaches every unit on the bus */
+
+int micstasy_group_set_values(struct micstasy_bus *bus, const struct micstasy_value *values, int count)
+{
+	int8_t data[2*MICSTASY_MAX_SET_PAIRS];
+	struct micstasy *unit;
+	int i, n;
+
+	if(check_values(values, count) == -1)
+		return -1;
+
+	/* every unit would end up with the same address or memory */
+	for(i=0; i<count; i++)
+		if(values[i].parameterNumber == 0x1C || values[i].parameterNumber == 0x1D){
+			error(MICSTASY_ERROR_ARGUMENT, "Error: memory recall and bank/device ID cannot be broadcast");
+			return -1;
+		}
+
+	for(i=0; i<count; i+=n)
+	{
+		n = pack_values(data, values+i, count-i, bus->setPairs);
+
+		if(sysex_write(bus, ADDRESS_BROADCAST, MESSAGETYPE_SET_VALUE, data, 2*n) == -1)
+			return -1;
+	}
+
+	/* bus->lock keeps the units open, shadow_update() nests unit->lock in it */
+	mutex_lock(&bus->lock);
+	for(unit = bus->units; unit != NULL; unit = unit->next)
+		for(i=0; i<count; i++)
+			shadow_update(unit, values[i].parameterNumber, values[i].value);
+	mutex_unlock(&bus->lock);
+
+	return 1;
+}
+
+
+/* changes the bits in mask of register parameterNumber on every unit. The
+   other bits differ per unit, so they are read first (from the shadow copy
+   if enabled). The largest group of units with the same target value gets
+   one broadcast, the others are corrected one by one afterwards; units
+   without a handle get the broadcast value, see micstasyc.h */
+static int group_set_bits(struct micstasy_bus *bus, int parameterNumber, int8_t mask, int8_t bits, struct micstasy_value *extra)
+{
+	int8_t registers[MICSTASY_REGISTER_COUNT];
+	struct micstasy **units;
+	struct micstasy *unit;
+	struct micstasy_value values[2];
+	int8_t *targets;
+	int unitCount = 0, i, j, n, best = 0, bestCount = 0, ret = 1;
+
+	mutex_lock(&bus->lock);
+	for(unit = bus->units; unit != NULL; unit = unit->next)
+		unitCount++;
+	units = (struct micstasy **) malloc((unitCount+1)*sizeof(struct micstasy *));
+	targets = (int8_t *) malloc(unitCount+1);
+	if(units == NULL || targets == NULL) {
+		mutex_unlock(&bus->lock);
+		free(units);
+		free(targets);
+		return error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+	}
+	unitCount = 0;
+	for(unit = bus->units; unit != NULL; unit = unit->next)
+		if(((unit->bankNumber<<4) | unit->deviceID) != ADDRESS_BROADCAST)
+			units[unitCount++] = unit;
+	mutex_unlock(&bus->lock);
+
+	if(unitCount == 0) {
+		ret = error(MICSTASY_ERROR_STATE, "Error: group operation needs a handle for every unit on the bus (micstasy_bus_unit)");
+	}
+
+	for(i=0; i<unitCount && ret != -1; i++) {
+		ret = read_registers(units[i], registers, BIT(parameterNumber));
+
+		if(ret != -1 && registers[parameterNumber] == -1)
+			ret = error(MICSTASY_ERROR_RESPONSE, "Error: register missing from the response");
+
+		if(ret != -1)
+			targets[i] = (registers[parameterNumber] & ~mask & writable_bits(parameterNumber)) | (bits & mask);
+	}
+
+	/* most common target value */
+	for(i=0; i<unitCount && ret != -1; i++) {
+		for(j=0, n=0; j<unitCount; j++)
+			if(targets[j] == targets[i])
+				n++;
+		if(n > bestCount) {
+			best = i;
+			bestCount = n;
+		}
+	}
+
+	values[0].parameterNumber = parameterNumber;
+	if(extra != NULL)
+		values[1] = *extra;
+
+	/* a broadcast only saves messages when it covers two units or more */
+	if(ret != -1 && (bestCount > 1 || unitCount == 1)) {
+		values[0].value = targets[best];
+		ret = micstasy_group_set_values(bus, values, extra != NULL ? 2 : 1);
+
+		for(i=0; i<unitCount && ret != -1; i++)
+			if(targets[i] != targets[best]) {
+				values[0].value = targets[i];
+				ret = micstasy_set_values(units[i], values, 1);
+			}
+	}
+	else {
+		for(i=0; i<unitCount && ret != -1; i++) {
+			values[0].value = targets[i];
+			ret = micstasy_set_values(units[i], values, extra != NULL ? 2 : 1);
+		}
+	}
+
+	free(targets);
+	free(units);
+
+	return ret;
+}
+
+
+int micstasy_group_set_gainCoarse(struct micstasy_bus *bus, int channel, int dbValue)
+{
+	struct micstasy_value value;
+
+	if(channel < 1 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (1..8)");
+		return -1;
+	}
+
+	value.parameterNumber = (channel-1)*3;
+	value.value = encode_gainCoarse(dbValue);
+	if(value.value == -1) return -1;
+
+	return micstasy_group_set_values(bus, &value, 1);
+}
+
+
+int micstasy_group_set_gain(struct micstasy_bus *bus, int channel, double dbValue)
+{
+	struct micstasy_value coarse;
+	int dbCoarse;
+	boolean gainFine;
+
+	if(channel < 1 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (1..8)");
+		return -1;
+	}
+
+	split_gain(dbValue, &dbCoarse, &gainFine);
+
+	coarse.parameterNumber = (channel-1)*3;
+	coarse.value = encode_gainCoarse(dbCoarse);
+	if(coarse.value == -1) return -1;
+
+	/* gain fine shares the parameters register, coarse gain goes along */
+	return group_set_bits(bus, (channel-1)*3+1, BIT(0), gainFine == 1 ? BIT(0) : 0, &coarse);
+}
+
+
+int micstasy_group_set_p48(struct micstasy_bus *bus, int channel, boolean p48)
+{
+	if(channel < 1 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (1..8)");
+		return -1;
+	}
+
+	return group_set_bits(bus, (channel-1)*3+2, BIT(6), p48 == 1 ? BIT(6) : 0, NULL);
+}
+
+
+int micstasy_group_set_loCut(struct micstasy_bus *bus, int channel, boolean loCut)
+{
+	if(channel < 1 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (1..8)");
+		return -1;
+	}
+
+	return group_set_bits(bus, (channel-1)*3+2, BIT(3), loCut == 1 ? BIT(3) : 0, NULL);
+}
+
+
+int micstasy_group_set_oscillator(struct micstasy_bus *bus, int channel)
+{
+	struct micstasy_value value;
+
+	if(channel < 0 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (0=off,1..8)");
+		return -1;
+	}
+
+	/* Oscillator: 0 = off, 1..8 = Channel 1..8 */
+	value.parameterNumber = 0x1E;
+	value.value = channel;
+
+	return micstasy_group_set_values(bus, &value, 1);
+}
+
+
+/* level meter streaming: one thread per bus polls every streaming unit that is
+   due with a single pipelined batch and pushes timestamped frames into the
+   unit's ring */
+
+static void meter_push(struct micstasy *cMicstasy, const struct micstasy_meterFrame *frame)
+{
+	uint32_t head = cMicstasy->meterHead;
+
+	if(head - cMicstasy->meterTail == MICSTASY_METER_RING_SIZE) {
+		cMicstasy->meterDropped++;
+		return;
+	}
+
+	cMicstasy->meterFrames[head & (MICSTASY_METER_RING_SIZE-1)] = *frame;
+	memory_barrier(); /* frame is complete before the consumer can see it */
+	cMicstasy->meterHead = head+1;
+}
+
+
+static THREAD_FUNCTION(meter_thread)
+{
+	struct micstasy_bus *bus = (struct micstasy_bus *)arg;
+	struct micstasy **units = NULL, **newUnits;
+	struct micstasy_request *requests = NULL, *newRequests;
+	struct micstasy_meterFrame frame;
+	struct micstasy *unit;
+	int capacity = 0, count, i;
+	uint64_t now, next;
+
+	while(bus->meterRunning)
+	{
+		now = clock_us();
+		next = now + RECEIVER_WAKEUP_US;
+		count = 0;
+
+		mutex_lock(&bus->lock);
+		for(unit = bus->units; unit != NULL; unit = unit->next)
+		{
+			if(!unit->meterStreaming)
+				continue;
+
+			if(unit->meterDue <= now)
+			{
+				if(count == capacity) {
+					/* out of memory: poll the others on the next tick */
+					newUnits = (struct micstasy **) realloc(units, (capacity*2 + 4)*sizeof(struct micstasy *));
+					if(newUnits == NULL)
+						break;
+					units = newUnits;
+					newRequests = (struct micstasy_request *) realloc(requests, (capacity*2 + 4)*sizeof(struct micstasy_request));
+					if(newRequests == NULL)
+						break;
+					requests = newRequests;
+					capacity = capacity*2 + 4;
+				}
+
+				/* stop and close wait until the poll is done with the unit */
+				unit->meterBusy++;
+				units[count] = unit;
+				requests[count].messageType = MESSAGETYPE_REQUEST_LEVELMETER_DATA;
+				requests[count].bankNumber = unit->bankNumber;
+				requests[count].deviceID = unit->deviceID;
+				count++;
+
+				/* stay on the rate grid, skip ticks we are too late for */
+				unit->meterDue += unit->meterPeriod;
+				if(unit->meterDue <= now)
+					unit->meterDue = now + unit->meterPeriod;
+			}
+
+			if(unit->meterDue < next)
+				next = unit->meterDue;
+		}
+		mutex_unlock(&bus->lock);
+
+		if(count > 0)
+		{
+			micstasy_pipeline(units[0], requests, count, count);
+
+			for(i=0; i<count; i++)
+			{
+				if(requests[i].status != 1 || !units[i]->meterStreaming)
+					continue;
+
+				frame.timestamp = now;
+				memcpy(frame.channel, requests[i].levelMeterData.channel, sizeof(frame.channel));
+
+				meter_push(units[i], &frame);
+
+				if(units[i]->meterCallback != NULL)
+					units[i]->meterCallback(units[i], &frame, units[i]->meterUserData);
+			}
+
+			mutex_lock(&bus->lock);
+			for(i=0; i<count; i++)
+				units[i]->meterBusy--;
+			cond_broadcast(&bus->meterCond);
+			mutex_unlock(&bus->lock);
+		}
+
+		now = clock_us();
+		if(next > now)
+			sleep_us(next-now);
+	}
+
+	free(units);
+	free(requests);
+
+	return THREAD_RETURN;
+}
+
+
+int micstasy_meter_stream_start(struct micstasy *cMicstasy, int rateHz, micstasy_meter_callback callback, void *userData)
+{
+	struct micstasy_bus *bus = cMicstasy->bus;
+	int ret = 1;
+
+	if(rateHz < 1 || rateHz > 1000){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: level meter rate out of range (1..1000 Hz)");
+		return -1;
+	}
+
+	mutex_lock(&bus->lock);
+
+	/* a stop in progress joins the thread before we can start a new one */
+	while(bus->meterStopping)
+		cond_wait_until(&bus->meterCond, &bus->lock, clock_us() + RECEIVER_WAKEUP_US);
+
+	cMicstasy->meterPeriod = 1000000/rateHz;
+	cMicstasy->meterDue = clock_us();
+	cMicstasy->meterCallback = callback;
+	cMicstasy->meterUserData = userData;
+	cMicstasy->meterStreaming = 1;
+
+	if(!bus->meterRunning) {
+		bus->meterRunning = 1;
+		if(thread_create(&bus->meterThread, meter_thread, bus) == -1) {
+			bus->meterRunning = 0;
+			cMicstasy->meterStreaming = 0;
+			ret = error(MICSTASY_ERROR_SYSTEM, "Error: unable to start level meter thread");
+		}
+	}
+
+	mutex_unlock(&bus->lock);
+
+	return ret;
+}
+
+
+/* drains up to maxFrames frames, oldest first; returns the number of frames */
+int micstasy_meter_stream_read(struct micstasy *cMicstasy, struct micstasy_meterFrame *frames, int maxFrames)
+{
+	uint32_t tail = cMicstasy->meterTail;
+	uint32_t head = cMicstasy->meterHead;
+	int count = 0;
+
+	memory_barrier(); /* read frames only after seeing head */
+
+	while(tail != head && count < maxFrames)
+	{
+		frames[count++] = cMicstasy->meterFrames[tail & (MICSTASY_METER_RING_SIZE-1)];
+		tail++;
+	}
+
+	memory_barrier(); /* frames are copied before the slots are handed back */
+	cMicstasy->meterTail = tail;
+
+	return count;
+}
+
+
+/* called with bus->lock held; returns 1 if the caller has to join the
+   thread with meter_thread_join() after releasing the lock */
+static int meter_thread_stopping(struct micstasy_bus *bus)
+{
+	if(!bus->meterRunning || bus->meterStopping)
+		return 0;
+
+	bus->meterRunning = 0;
+	bus->meterStopping = 1;
+
+	return 1;
+}
+
+
+static void meter_thread_join(struct micstasy_bus *bus)
+{
+	thread_join(bus->meterThread);
+
+	mutex_lock(&bus->lock);
+	bus->meterStopping = 0;
+	cond_broadcast(&bus->meterCond);
+	mutex_unlock(&bus->lock);
+}
+
+
+static void meter_thread_stop(struct micstasy_bus *bus)
+{
+	int join;
+
+	mutex_lock(&bus->lock);
+	join = meter_thread_stopping(bus);
+	mutex_unlock(&bus->lock);
+
+	if(join)
+		meter_thread_join(bus);
+}
+
+
+int micstasy_meter_stream_stop(struct micstasy *cMicstasy)
+{
+	struct micstasy_bus *bus = cMicstasy->bus;
+	struct micstasy *unit;
+	boolean streaming = 0;
+	int join = 0;
+
+	mutex_lock(&bus->lock);
+
+	cMicstasy->meterStreaming = 0;
+
+	/* no callback runs for this unit once we return */
+	while(cMicstasy->meterBusy > 0)
+		cond_wait_until(&bus->meterCond, &bus->lock, clock_us() + RECEIVER_WAKEUP_US);
+
+	for(unit = bus->units; unit != NULL; unit = unit->next)
+		if(unit->meterStreaming)
+			streaming = 1;
+
+	if(!streaming)
+		join = meter_thread_stopping(bus);
+
+	mutex_unlock(&bus->lock);
+
+	if(join)
+		meter_thread_join(bus);
+
+	return 1;
+}
+
+
+/* async operations: one worker thread per bus runs queued jobs in order
+   through the blocking API and reports each through its callback or the
+   bus completion queue */
+
+struct micstasy_job {
+	struct micstasy_completion completion;
+	micstasy_async_callback callback;
+	struct micstasy_job *next;
+};
+
+
+static void async_run(struct micstasy_job *job)
+{
+	struct micstasy_completion *c = &job->completion;
+	struct micstasy *unit = c->unit;
+
+	errorCode = MICSTASY_OK;
+	errorMessage = NULL;
+
+	switch(c->operation)
+	{
+		case MICSTASY_ASYNC_GET_GAIN:
+			micstasy_get_gain(unit, c->channel, &c->value.gain);
+			break;
+		case MICSTASY_ASYNC_SET_GAIN:
+			micstasy_set_gain(unit, c->channel, c->value.gain);
+			break;
+		case MICSTASY_ASYNC_GET_GAINCOARSE:
+			c->value.gainCoarse = micstasy_get_gainCoarse(unit, c->channel);
+			break;
+		case MICSTASY_ASYNC_SET_GAINCOARSE:
+			micstasy_set_gainCoarse(unit, c->channel, c->value.gainCoarse);
+			break;
+		case MICSTASY_ASYNC_GET_PARAMETERS:
+			micstasy_get_parameters(unit, c->channel, &c->value.parameters);
+			break;
+		case MICSTASY_ASYNC_SET_PARAMETERS:
+			micstasy_set_parameters(unit, c->channel, c->value.parameters.gainFine, c->value.parameters.displayAutoDark,
+				c->value.parameters.autoSetLink, c->value.parameters.digitalOutSelect);
+			break;
+		case MICSTASY_ASYNC_GET_SETTINGS:
+			micstasy_get_settings(unit, c->channel, &c->value.settings);
+			break;
+		case MICSTASY_ASYNC_SET_SETTINGS:
+			micstasy_set_settings(unit, c->channel, c->value.settings.input, c->value.settings.HiZ, c->value.settings.autoset,
+				c->value.settings.loCut, c->value.settings.MS, c->value.settings.phase, c->value.settings.p48);
+			break;
+		case MICSTASY_ASYNC_GET_SETUP:
+			micstasy_get_setup(unit, &c->value.setup);
+			break;
+		case MICSTASY_ASYNC_SET_SETUP:
+			micstasy_setup(unit, c->value.setup.intFreq, c->value.setup.clockRange, c->value.setup.clockSelect,
+				c->value.setup.analogOutput, c->value.setup.lockKeys, c->value.setup.peakHold, c->value.setup.followClock,
+				c->value.setup.autosetLimit, c->value.setup.delayCompensation, c->value.setup.autoDevice);
+			break;
+		case MICSTASY_ASYNC_GET_LOCKSYNCINFO:
+			micstasy_get_locksyncInfo(unit, &c->value.locksyncInfo);
+			break;
+		case MICSTASY_ASYNC_GET_LEVELMETERDATA:
+			micstasy_get_levelMeterData(unit, &c->value.levelMeterData);
+			break;
+		case MICSTASY_ASYNC_SCENE_APPLY:
+			micstasy_scene_apply(unit, c->value.sceneApply.scene, c->value.sceneApply.delta);
+			break;
+	}
+
+	/* some getters return data where others return status, so success is
+	   judged by the error state of this thread */
+	c->errorCode = errorCode;
+	c->errorMessage = micstasy_errorMessage();
+	c->status = errorCode == MICSTASY_OK ? 1 : -1;
+}
+
+
+static THREAD_FUNCTION(async_thread)
+{
+	struct micstasy_bus *bus = (struct micstasy_bus *)arg;
+	struct micstasy_job *job;
+
+	mutex_lock(&bus->lock);
+
+	while(bus->asyncRunning)
+	{
+		if(bus->jobs == NULL) {
+			cond_wait_until(&bus->asyncCond, &bus->lock, clock_us() + RECEIVER_WAKEUP_US);
+			continue;
+		}
+
+		job = bus->jobs;
+		bus->jobs = job->next;
+		bus->asyncUnit = job->completion.unit;
+		mutex_unlock(&bus->lock);
+
+		async_run(job);
+
+		if(job->callback != NULL) {
+			job->callback(&job->completion);
+			free(job);
+			job = NULL;
+		}
+
+		mutex_lock(&bus->lock);
+		bus->asyncUnit = NULL;
+
+		if(job != NULL) {
+			job->next = NULL;
+			if(bus->completed == NULL)
+				bus->completed = job;
+			else
+				bus->completedTail->next = job;
+			bus->completedTail = job;
+		}
+
+		cond_broadcast(&bus->asyncCond);
+	}
+
+	mutex_unlock(&bus->lock);
+
+	return THREAD_RETURN;
+}
+
+
+/* queues a job; returns its token, or -1 */
+static int async_submit(struct micstasy *cMicstasy, int operation, int channel, const void *value, size_t valueSize,
+		micstasy_async_callback callback, void *userData)
+{
+	struct micstasy_bus *bus = cMicstasy->bus;
+	struct micstasy_job *job;
+	int token;
+
+	job = (struct micstasy_job *) calloc(1, sizeof(struct micstasy_job));
+	if(job == NULL)
+		return error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+
+	job->completion.operation = operation;
+	job->completion.unit = cMicstasy;
+	job->completion.channel = channel;
+	job->completion.userData = userData;
+	if(value != NULL)
+		memcpy(&job->completion.value, value, valueSize);
+	job->callback = callback;
+
+	mutex_lock(&bus->lock);
+
+	if(!bus->asyncRunning) {
+		bus->asyncRunning = 1;
+		if(thread_create(&bus->asyncThread, async_thread, bus) == -1) {
+			bus->asyncRunning = 0;
+			mutex_unlock(&bus->lock);
+			free(job);
+			return error(MICSTASY_ERROR_SYSTEM, "Error: unable to start async worker thread");
+		}
+	}
+
+	if(++bus->asyncToken <= 0)
+		bus->asyncToken = 1;
+	token = job->completion.token = bus->asyncToken;
+
+	if(bus->jobs == NULL)
+		bus->jobs = job;
+	else
+		bus->jobsTail->next = job;
+	bus->jobsTail = job;
+
+	cond_broadcast(&bus->asyncCond);
+	mutex_unlock(&bus->lock);
+
+	return token;
+}
+
+
+static void async_thread_stop(struct micstasy_bus *bus)
+{
+	struct micstasy_job *job;
+
+	mutex_lock(&bus->lock);
+	if(bus->asyncRunning) {
+		bus->asyncRunning = 0;
+		cond_broadcast(&bus->asyncCond);
+		mutex_unlock(&bus->lock);
+		thread_join(bus->asyncThread);
+		mutex_lock(&bus->lock);
+	}
+
+	/* jobs not run yet and unclaimed completions are dropped */
+	while((job = bus->jobs) != NULL) {
+		bus->jobs = job->next;
+		free(job);
+	}
+	while((job = bus->completed) != NULL) {
+		bus->completed = job->next;
+		free(job);
+	}
+	mutex_unlock(&bus->lock);
+}
+
+
+/* drops the jobs and completions of a unit that is about to be freed */
+static void async_forget_unit(struct micstasy *cMicstasy)
+{
+	struct micstasy_bus *bus = cMicstasy->bus;
+	struct micstasy_job **job, *tail, *next;
+
+	mutex_lock(&bus->lock);
+
+	while(bus->asyncUnit == cMicstasy)
+		cond_wait_until(&bus->asyncCond, &bus->lock, clock_us() + RECEIVER_WAKEUP_US);
+
+	for(tail = NULL, job = &bus->jobs; *job != NULL; )
+		if((*job)->completion.unit == cMicstasy) {
+			next = (*job)->next;
+			free(*job);
+			*job = next;
+		}
+		else {
+			tail = *job;
+			job = &(*job)->next;
+		}
+	bus->jobsTail = tail;
+
+	for(tail = NULL, job = &bus->completed; *job != NULL; )
+		if((*job)->completion.unit == cMicstasy) {
+			next = (*job)->next;
+			free(*job);
+			*job = next;
+		}
+		else {
+			tail = *job;
+			job = &(*job)->next;
+		}
+	bus->completedTail = tail;
+
+	mutex_unlock(&bus->lock);
+}
+
+
+/* takes the oldest completion of a job submitted without callback;
+   returns 1 if there was one, 0 if not */
+int micstasy_async_poll(struct micstasy_bus *bus, struct micstasy_completion *completion)
+{
+	return micstasy_async_wait(bus, completion, 0);
+}
+
+
+/* as micstasy_async_poll(), waiting up to timeoutMs for a completion */
+int micstasy_async_wait(struct micstasy_bus *bus, struct micstasy_completion *completion, int timeoutMs)
+{
+	uint64_t deadline = clock_us() + (uint64_t)(timeoutMs > 0 ? timeoutMs : 0)*1000;
+	struct micstasy_job *job;
+
+	mutex_lock(&bus->lock);
+
+	while(bus->completed == NULL && clock_us() < deadline)
+		cond_wait_until(&bus->asyncCond, &bus->lock, deadline);
+
+	job = bus->completed;
+	if(job != NULL)
+		bus->completed = job->next;
+
+	mutex_unlock(&bus->lock);
+
+	if(job == NULL)
+		return 0;
+
+	*completion = job->completion;
+	free(job);
+
+	return 1;
+}
+
+
+static int check_channel(int channel)
+{
+	if(channel < 1 || channel > 8)
+		return error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (1..8)");
+
+	return 1;
+}
+
+
+int micstasy_async_get_gain(struct micstasy *cMicstasy, int channel, micstasy_async_callback callback, void *userData)
+{
+	if(check_channel(channel) == -1) return -1;
+
+	return async_submit(cMicstasy, MICSTASY_ASYNC_GET_GAIN, channel, NULL, 0, callback, userData);
+}
+
+
+int micstasy_async_set_gain(struct micstasy *cMicstasy, int channel, double dbValue, micstasy_async_callback callback, void *userData)
+{
+	if(check_channel(channel) == -1) return -1;
+
+	return async_submit(cMicstasy, MICSTASY_ASYNC_SET_GAIN, channel, &dbValue, sizeof(dbValue), callback, userData);
+}
+
+
+int micstasy_async_get_gainCoarse(struct micstasy *cMicstasy, int channel, micstasy_async_callback callback, void *userData)
+{
+	if(check_channel(channel) == -1) return -1;
+
+	return async_submit(cMicstasy, MICSTASY_ASYNC_GET_GAINCOARSE, channel, NULL, 0, callback, userData);
+}
+
+
+int micstasy_async_set_gainCoarse(struct micstasy *cMicstasy, int channel, int dbValue, micstasy_async_callback callback, void *userData)
+{
+	if(check_channel(channel) == -1) return -1;
+
+	return async_submit(cMicstasy, MICSTASY_ASYNC_SET_GAINCOARSE, channel, &dbValue, sizeof(dbValue), callback, userData);
+}
+
+
+int micstasy_async_get_parameters(struct micstasy *cMicstasy, int channel, micstasy_async_callback callback, void *userData)
+{
+	if(check_channel(channel) == -1) return -1;
+
+	return async_submit(cMicstasy, MICSTASY_ASYNC_GET_PARAMETERS, channel, NULL, 0, callback, userData);
+}
+
+
+/* the channel is taken from parameters->channel */
+int micstasy_async_set_parameters(struct micstasy *cMicstasy, const struct micstasy_parameters *parameters, micstasy_async_callback callback, void *userData)
+{
+	if(check_channel(parameters->channel) == -1) return -1;
+
+	return async_submit(cMicstasy, MICSTASY_ASYNC_SET_PARAMETERS, parameters->channel, parameters, sizeof(*parameters), callback, userData);
+}
+
+
+int micstasy_async_get_settings(struct micstasy *cMicstasy, int channel, micstasy_async_callback callback, void *userData)
+{
+	if(check_channel(channel) == -1) return -1;
+
+	return async_submit(cMicstasy, MICSTASY_ASYNC_GET_SETTINGS, channel, NULL, 0, callback, userData);
+}
+
+
+/* the channel is taken from settings->channel */
+int micstasy_async_set_settings(struct micstasy *cMicstasy, const struct micstasy_settings *settings, micstasy_async_callback callback, void *userData)
+{
+	if(check_channel(settings->channel) == -1) return -1;
+
+	return async_submit(cMicstasy, MICSTASY_ASYNC_SET_SETTINGS, settings->channel, settings, sizeof(*settings), callback, userData);
+}
+
+
+int micstasy_async_get_setup(struct micstasy *cMicstasy, micstasy_async_callback callback, void *userData)
+{
+	return async_submit(cMicstasy, MICSTASY_ASYNC_GET_SETUP, 0, NULL, 0, callback, userData);
+}
+
 
-	value |= (autosetLimit << 3); /* Autoset-Limit: 0 = -1dB, 1 = -3dB, 2 = -6dB, 3 = -12dB */
+int micstasy_async_set_setup(struct micstasy *cMicstasy, const struct micstasy_setup *setup, micstasy_async_callback callback, void *userData)
+{
+	return async_submit(cMicstasy, MICSTASY_ASYNC_SET_SETUP, 0, setup, sizeof(*setup), callback, userData);
+}
 
-	if(delayCompensation == 1)
-		value |= (1<<5); /* Delay Compensation: 0 = off, 1 = on */
-	if(autoDevice == 1)
-		value |= (1<<6); /* Auto-Device: 0 = off, 1 = on */
 
-	ret = micstasy_set_value(cMicstasy, parameterNumber, value);
+int micstasy_async_get_locksyncInfo(struct micstasy *cMicstasy, micstasy_async_callback callback, void *userData)
+{
+	return async_submit(cMicstasy, MICSTASY_ASYNC_GET_LOCKSYNCINFO, 0, NULL, 0, callback, userData);
+}
 
 
-	return ret;
+int micstasy_async_get_levelMeterData(struct micstasy *cMicstasy, micstasy_async_callback callback, void *userData)
+{
+	return async_submit(cMicstasy, MICSTASY_ASYNC_GET_LEVELMETERDATA, 0, NULL, 0, callback, userData);
 }
 
 
-int micstasy_get_setup(struct micstasy *cMicstasy, struct micstasy_setup *setup)
+int micstasy_async_scene_apply(struct micstasy *cMicstasy, const struct micstasy_scene *scene, boolean delta, micstasy_async_callback callback, void *userData)
 {
-	int value;
-	int parameterNumber;
+	struct micstasy_completion c;
 
+	c.value.sceneApply.scene = scene;
+	c.value.sceneApply.delta = delta;
 
-	parameterNumber = 0x18; /* setup 1 */
+	return async_submit(cMicstasy, MICSTASY_ASYNC_SCENE_APPLY, 0, &c.value.sceneApply, sizeof(c.value.sceneApply), callback, userData);
+}
 
-	value = micstasy_request_value(cMicstasy, parameterNumber);
-	if(value == -1) return -1;
 
-	setup->intFreq = (value & BIT(0));
-	setup->clockRange = (value & (BIT(1) | BIT(2))) >> 1;
-	setup->clockSelect = (value & (BIT(3) | BIT(4))) >> 3;
-	setup->analogOutput = (value & (BIT(5) | BIT(6))) >> 5;
+/* scheduled output: a time sorted list, sent by one thread per bus. The
+   thread sleeps on scheduleCond until shortly before an item is due and
+   polls the clock for the rest, as condition variables wake up late.
+   The same thread runs the gain ramps */
 
-	parameterNumber = 0x19; /* setup 2 */
+struct micstasy_scheduled {
+	int id;
+	uint64_t due;			/* us, micstasy_clock_us() */
+	struct micstasy *unit;
+	boolean delta;			/* leave out values the shadow cache already holds */
+	int count;
+	struct micstasy_value *values;
+	struct micstasy_scheduled *next;
+};
 
-	value = micstasy_request_value(cMicstasy, parameterNumber);
-	if(value == -1) return -1;
 
-	setup->lockKeys = (value & BIT(0));
-	setup->peakHold = (value & BIT(1))>>1;
-	setup->followClock = (value & BIT(2))>>2;
-	setup->autosetLimit  = (value & (BIT(3) | BIT(4)))>>3;
-	setup->delayCompensation = (value & BIT(5))>>5;
-	setup->autoDevice = (value & BIT(6))>>6;
+static void schedule_send(struct micstasy_bus *bus, struct micstasy_scheduled *item)
+{
+	struct micstasy *cMicstasy = item->unit;
+	int8_t parameterNumber, mask;
+	int i, count = 0;
 
+	stats_latency(bus, MICSTASY_STAT_SCHEDULE, item->due);
 
-	return 1;
+	/* decided now, without a read that would make the output late */
+	if(item->delta)
+	{
+		mutex_lock(&cMicstasy->lock);
+		for(i=0; i<item->count; i++)
+		{
+			parameterNumber = item->values[i].parameterNumber;
+			mask = writable_bits(parameterNumber);
+
+			if(parameterNumber < MICSTASY_REGISTER_COUNT && (BIT(parameterNumber) & SHADOW_CACHEABLE) &&
+			   shadow_is_fresh(cMicstasy, BIT(parameterNumber)) &&
+			   (cMicstasy->shadow[parameterNumber] & mask) == (item->values[i].value & mask))
+				continue;
+
+			item->values[count++] = item->values[i];
+		}
+		mutex_unlock(&cMicstasy->lock);
+	}
+	else
+		count = item->count;
+
+	if(count > 0 && micstasy_set_values(cMicstasy, item->values, count) == -1)
+		stats_count(bus, &bus->stats.scheduleErrors, 1);
 }
 
 
+static void ramp_tick(struct micstasy_bus *bus);
 
-int micstasy_get_locksyncInfo(struct micstasy *cMicstasy, struct micstasy_locksyncInfo *synclock)
+
+static THREAD_FUNCTION(scheduler_thread)
 {
-	char parameterNumber = 0x1A;
-	char value;
+	struct micstasy_bus *bus = (struct micstasy_bus *)arg;
+	struct micstasy_scheduled *item;
+	uint64_t now, wakeup;
 
+	mutex_lock(&bus->lock);
 
-	value = micstasy_request_value(cMicstasy, parameterNumber);
+	while(bus->schedulerRunning)
+	{
+		item = bus->schedule;
+		now = clock_us();
 
-	memset(synclock, -1, sizeof(*synclock));
+		if(item == NULL || item->due > now)
+		{
+			if(bus->ramps != NULL && bus->rampDue <= now) {
+				ramp_tick(bus);
+				continue;
+			}
 
-	if(value != -1)
-	{
-		synclock->optionLock = (value & BIT(0));
-		synclock->optionSync  = (value & BIT(1))>>1;
-		synclock->aesLock   = (value & BIT(2))>>2;
-		synclock->aesSync = (value & BIT(3))>>3;
-		synclock->wckLock   = (value & BIT(4))>>4;
-		synclock->wckSync = (value & BIT(5))>>5;
-		synclock->wcOut = (value & BIT(6))>>6;
+			wakeup = now + RECEIVER_WAKEUP_US;
+			if(bus->ramps != NULL && bus->rampDue < wakeup)
+				wakeup = bus->rampDue;
+			if(item != NULL && item->due < wakeup + SCHEDULE_SPIN_US)
+				wakeup = item->due > now + SCHEDULE_SPIN_US ? item->due - SCHEDULE_SPIN_US : now;
+
+			if(wakeup > now)
+				cond_wait_until(&bus->scheduleCond, &bus->lock, wakeup);
+			else {
+				mutex_unlock(&bus->lock);
+				sleep_us(item->due - now < SCHEDULE_POLL_US ? 0 : SCHEDULE_POLL_US);
+				mutex_lock(&bus->lock);
+			}
+			continue;
+		}
+
+		bus->schedule = item->next;
+		bus->scheduleUnit = item->unit;
+		mutex_unlock(&bus->lock);
 
+		schedule_send(bus, item);
+		free(item->values);
+		free(item);
+
+		mutex_lock(&bus->lock);
+		bus->scheduleUnit = NULL;
+		cond_broadcast(&bus->scheduleCond);
 	}
-/*
-	MSB / 7		0
-	6		WC Out: 0 = Fs, 1 = Single Speed
-	5		WCK Sync: 0 = no sync, 1 = sync
-	4		WCK Lock: 0 = unlock, 1 = lock
-	3		AES Sync: 0 = no sync, 1 = sync
-	2		AES Lock: 0 = unlock, 1 = lock
-	1		Option Sync: 0 = no sync, 1 = sync
-	LSB / 0 	Option Lock: 0 = unlock, 1 = lock 
-*/
-	
 
-	return value;
+	mutex_unlock(&bus->lock);
+
+	return THREAD_RETURN;
 }
 
 
-int micstasy_set_bankdevID(struct micstasy *cMicstasy, int8_t bankID, int8_t devID)
+/* called with bus->lock held */
+static int scheduler_start(struct micstasy_bus *bus)
 {
+	if(bus->schedulerRunning)
+		return 1;
 
-	int ret;
-	int8_t bankdevID, parameterNumber = 0x1D;
+	bus->schedulerRunning = 1;
+	if(thread_create(&bus->schedulerThread, scheduler_thread, bus) == -1) {
+		bus->schedulerRunning = 0;
+		return error(MICSTASY_ERROR_SYSTEM, "Error: unable to start scheduler thread");
+	}
 
-	bankdevID = (bankID<<4) | devID;
+	return 1;
+}
+
+
+/* queues values for the unit at when; returns the id, or -1 */
+static int schedule_submit(struct micstasy *cMicstasy, uint64_t when, const struct micstasy_value *values, int count, boolean delta)
+{
+	struct micstasy_bus *bus = cMicstasy->bus;
+	struct micstasy_scheduled *item, **position;
+	int id;
 
-	if( (bankdevID < 0x00 || bankdevID > 0x77) && bankdevID != 0x7F){
-		error("Error: bankdevID out of range 0x00..0x77, 0x7F");
+	if(count < 1){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: nothing to schedule");
 		return -1;
 	}
 
-	ret = micstasy_set_value(cMicstasy, parameterNumber, bankdevID);
+	if(check_values(values, count) == -1)
+		return -1;
 
-	return ret;
-}
+	item = (struct micstasy_scheduled *) calloc(1, sizeof(struct micstasy_scheduled));
+	if(item != NULL)
+		item->values = (struct micstasy_value *) malloc(count*sizeof(struct micstasy_value));
+	if(item == NULL || item->values == NULL) {
+		free(item);
+		return error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+	}
 
+	item->due = when;
+	item->unit = cMicstasy;
+	item->delta = delta;
+	item->count = count;
+	memcpy(item->values, values, count*sizeof(struct micstasy_value));
 
-int micstasy_set_oscillator(struct micstasy *cMicstasy, int channel)
-{
-	int ret;
-	char parameterNumber = 0x1E;
+	mutex_lock(&bus->lock);
 
-	if(channel < 0 || channel > 8){
-		error("Error: channel out of range (0=off,1..8)");
+	if(scheduler_start(bus) == -1) {
+		mutex_unlock(&bus->lock);
+		free(item->values);
+		free(item);
 		return -1;
 	}
 
-	/* Oscillator: 0 = off, 1..8 = Channel 1..8 */
-	ret = micstasy_set_value(cMicstasy, parameterNumber, channel);
-	
-	return ret;
+	if(++bus->scheduleId <= 0)
+		bus->scheduleId = 1;
+	id = item->id = bus->scheduleId;
+
+	/* items due at the same time go out in the order they were queued */
+	for(position = &bus->schedule; *position != NULL && (*position)->due <= when; position = &(*position)->next);
+	item->next = *position;
+	*position = item;
+
+	cond_broadcast(&bus->scheduleCond);
+	mutex_unlock(&bus->lock);
+
+	return id;
 }
 
-int micstasy_memory_save(struct micstasy *cMicstasy, int slot)
+
+/* sends the values at when (micstasy_clock_us() time, us); output that is
+   due already goes out at once. Returns an id for micstasy_schedule_cancel() */
+int micstasy_schedule_values(struct micstasy *cMicstasy, uint64_t when, const struct micstasy_value *values, int count)
 {
-	int ret;
-	char parameterNumber = 0x1B;
+	return schedule_submit(cMicstasy, when, values, count, 0);
+}
 
-	if(slot < 0 || slot > 8){
-		error("Error: slot out of range (0=idle, 1..8)");
+
+/* recalls the scene at when. Nothing is read from the unit then: with delta
+   only registers that differ from a fresh shadow cache are written, else all */
+int micstasy_schedule_scene(struct micstasy *cMicstasy, uint64_t when, const struct micstasy_scene *scene, boolean delta)
+{
+	struct micstasy_value values[MICSTASY_SCENE_REGISTERS];
+	int i, unit;
+
+	if((unit = scene_find_unit(cMicstasy, scene)) == -1)
 		return -1;
+
+	for(i=0; i<MICSTASY_SCENE_REGISTERS; i++) {
+		values[i].parameterNumber = i;
+		values[i].value = scene->units[unit].registers[i] & writable_bits(i);
 	}
 
-	/* 0 = idle, 1..8 save memory 1..8 */
-	ret = micstasy_set_value(cMicstasy, parameterNumber, slot);
-	
-	return ret;
+	return schedule_submit(cMicstasy, when, values, MICSTASY_SCENE_REGISTERS, delta);
 }
 
-int micstasy_memory_recall(struct micstasy *cMicstasy, int slot)
+
+/* takes back output that has not been sent yet */
+int micstasy_schedule_cancel(struct micstasy_bus *bus, int id)
 {
-	int ret;
-	char parameterNumber = 0x1C;
+	struct micstasy_scheduled **position, *item;
 
-	if(slot < 0 || slot > 8){
-		error("Error: slot out of range (0=idle, 1..8)");
+	mutex_lock(&bus->lock);
+
+	for(position = &bus->schedule; *position != NULL && (*position)->id != id; position = &(*position)->next);
+
+	item = *position;
+	if(item != NULL)
+		*position = item->next;
+
+	mutex_unlock(&bus->lock);
+
+	if(item == NULL){
+		error(MICSTASY_ERROR_NOT_FOUND, "Error: nothing scheduled with this id");
 		return -1;
 	}
 
-	/* 0 = idle, 1..8 recall memory 1..8 */
-	ret = micstasy_set_value(cMicstasy, parameterNumber, slot);
-	
-	return ret;
+	free(item->values);
+	free(item);
+
+	return 1;
 }
 
 
-int micstasy_store_state(struct micstasy *cMicstasy, char *filePath)
+/* gain ramps: the scheduler recomputes where each ramp should be whenever
+   the link is free again and sends every channel of a unit that moved in
+   one SET_VALUE message, so steps the link had no time for are skipped */
+
+struct micstasy_ramp {
+	struct micstasy *unit;
+	int channel;
+	int8_t parameters;		/* parameters register without the fine gain bit */
+	int from, to;			/* gain steps of 0.5 dB from -9 dB */
+	int sent;			/* step the unit is at */
+	int curve;
+	uint64_t start;			/* us */
+	uint64_t duration;		/* us */
+	struct micstasy_ramp *next;
+};
+
+#define GAIN_STEPS 171			/* -9..76.5 dB */
+
+static int gain_step(double dbValue)
 {
-	char gainCoarse;
-	struct micstasy_parameters parameters;
-	struct micstasy_settings settings;
-	struct micstasy_setup setup;
-	int channel, ret;
-	FILE *stateFile;
+	int step = (int)floor((dbValue+9)*2 + 0.5);
+
+	return step < 0 ? 0 : step > GAIN_STEPS ? GAIN_STEPS : step;
+}
 
 
-	stateFile = fopen(filePath, "w");
-	if(stateFile == NULL) {
-		error("ERROR: unable to open file");
-		return -1;
+/* where the ramp should be at now */
+static int ramp_position(const struct micstasy_ramp *ramp, uint64_t now)
+{
+	double x, from, to;
+
+	if(now >= ramp->start + ramp->duration)
+		return ramp->to;
+
+	x = (double)(now - ramp->start) / ramp->duration;
+
+	switch(ramp->curve)
+	{
+		case MICSTASY_RAMP_SCURVE:
+			x = 0.5 - 0.5*cos(RAMP_PI*x);
+			break;
+
+		case MICSTASY_RAMP_AMPLITUDE:
+			from = pow(10, (ramp->from/2.0 - 9)/20);
+			to = pow(10, (ramp->to/2.0 - 9)/20);
+			return gain_step(20*log10(from + (to-from)*x));
 	}
 
-	for(channel=1; channel <= 8; channel++) {
-		gainCoarse = micstasy_get_gainCoarse(cMicstasy, channel);
-		micstasy_get_parameters(cMicstasy, channel, &parameters);
-		micstasy_get_settings(cMicstasy, channel, &settings);
+	return (int)floor(ramp->from + (ramp->to - ramp->from)*x + 0.5);
+}
 
-		fprintf(stateFile, "%d \n", gainCoarse);
-		fprintf(stateFile, "%d %d %d %d \n", parameters.gainFine, parameters.digitalOutSelect, parameters.autoSetLink, parameters.displayAutoDark);
-		fprintf(stateFile, "%d %d %d %d %d %d \n", settings.input, settings.HiZ, settings.loCut, settings.MS, settings.phase, settings.p48);
 
+/* sends the ramps that moved; called from the scheduler thread with
+   bus->lock held, which is released while sending */
+static void ramp_tick(struct micstasy_bus *bus)
+{
+	struct micstasy_value values[16];
+	struct micstasy_ramp **position, *ramp;
+	struct micstasy *unit;
+	uint64_t now = clock_us(), linkFree = now;
+	uint64_t steps, skipped;
+	int count, step, distance, ret;
 
-		if(DEBUG) {
-			printf("channel: %d\n", channel);
-			printf("gainCoarse: %d\n\n", gainCoarse);
-			printf("gainFine: %d\n digitalOutSelect: %d\nautoSetLink: %d\n displayAutoDark: %d\n\n", parameters.gainFine, parameters.digitalOutSelect, parameters.autoSetLink, parameters.displayAutoDark);
-			printf("input: %d\n HiZ: %d\n loCut: %d\n MS: %d\n Phase: %d\n p48: %d\n\n", settings.input, settings.HiZ, settings.loCut, settings.MS, settings.phase, settings.p48);
+	while(1)
+	{
+		unit = NULL;
+		count = 0;
+		steps = skipped = 0;
 
+		for(ramp = bus->ramps; ramp != NULL; ramp = ramp->next)
+		{
+			if(unit != NULL && ramp->unit != unit)
+				continue;
+
+			step = ramp_position(ramp, now);
+			if(step == ramp->sent)
+				continue;
+
+			unit = ramp->unit;
+			values[count].parameterNumber = (ramp->channel-1)*3;
+			values[count++].value = step/2;
+			values[count].parameterNumber = (ramp->channel-1)*3+1;
+			values[count++].value = ramp->parameters | (step & 1);
+
+			distance = step > ramp->sent ? step - ramp->sent : ramp->sent - step;
+			steps++;
+			skipped += distance-1;
+			ramp->sent = step;
 		}
 
-	}
+		if(unit == NULL)
+			break;
 
-	ret = micstasy_get_setup(cMicstasy, &setup);
+		bus->scheduleUnit = unit;
+		mutex_unlock(&bus->lock);
 
-	fprintf(stateFile, "%d %d %d %d %d %d %d %d %d %d \n",
-	setup.intFreq, setup.clockRange, setup.clockSelect, setup.analogOutput, setup.lockKeys, setup.peakHold, setup.followClock, setup.autosetLimit, setup.delayCompensation, setup.autoDevice);
+		ret = micstasy_set_values(unit, values, count);
 
-	fclose(stateFile);
+		mutex_lock(&bus->statsLock);
+		if(ret == -1)
+			bus->stats.scheduleErrors++;
+		bus->stats.rampSteps += steps;
+		bus->stats.rampStepsSkipped += skipped;
+		mutex_unlock(&bus->statsLock);
 
-	return ret;
+		/* the messages keep the link busy for their length */
+		if(linkFree < clock_us())
+			linkFree = clock_us();
+		linkFree += (8*((count + bus->setPairs-1) / bus->setPairs) + 2*count) * MIDI_BYTE_US;
+
+		mutex_lock(&bus->lock);
+		bus->scheduleUnit = NULL;
+		cond_broadcast(&bus->scheduleCond);
+	}
+
+	/* finished ramps leave, the unit stays at the target */
+	for(position = &bus->ramps; *position != NULL; )
+		if((*position)->sent == (*position)->to && now >= (*position)->start + (*position)->duration) {
+			ramp = *position;
+			*position = ramp->next;
+			free(ramp);
+		}
+		else
+			position = &(*position)->next;
+
+	bus->rampDue = linkFree > now + RAMP_TICK_US ? linkFree : now + RAMP_TICK_US;
 }
 
-int micstasy_restore_state(struct micstasy *cMicstasy, char *filePath)
+
+/* called with bus->lock held; returns 1 if a ramp was removed */
+static int ramp_remove(struct micstasy_bus *bus, struct micstasy *cMicstasy, int channel)
 {
-	int gainCoarse;
-	struct micstasy_settings settings;
-	struct micstasy_setup setup;
-	int ret;
-	FILE *stateFile;
-	int gainFine, digitalOutSelect, autoSetLink, displayAutoDark;
-	int channel, input, HiZ, autoset, loCut, MS, phase, p48;
-	int intFreq, clockRange, clockSelect, analogOutput, lockKeys, peakHold, followClock, autosetLimit, delayCompensation, autoDevice;
+	struct micstasy_ramp **position, *ramp;
+
+	for(position = &bus->ramps; *position != NULL; position = &(*position)->next)
+		if((*position)->unit == cMicstasy && (*position)->channel == channel) {
+			ramp = *position;
+			*position = ramp->next;
+			free(ramp);
+			return 1;
+		}
+
+	return 0;
+}
 
 
-	stateFile = fopen(filePath, "r");
-	if(stateFile == NULL) {
-		error("ERROR: unable to open file");
+/* fades the gain of a channel to targetDb over durationMs in 0.5 dB steps.
+   Returns at once, the bus scheduler sends the steps. A ramp already
+   running on the channel is replaced and the new one starts where it is */
+int micstasy_ramp_gain(struct micstasy *cMicstasy, int channel, double targetDb, int durationMs, int curve)
+{
+	struct micstasy_bus *bus = cMicstasy->bus;
+	struct micstasy_ramp *ramp, *running;
+	int8_t registers[MICSTASY_REGISTER_COUNT];
+	int gainRegister = (channel-1)*3, parameterRegister = gainRegister+1;
+
+	if(channel < 1 || channel > 8){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: channel out of range (1..8)");
+		return -1;
+	}
+	if(targetDb < -9 || targetDb > 76.5){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: dB Value out of range (-9..76.5 dB)");
+		return -1;
+	}
+	if(durationMs < 0){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: ramp duration must not be negative (ms)");
+		return -1;
+	}
+	if(curve != MICSTASY_RAMP_LINEAR && curve != MICSTASY_RAMP_SCURVE && curve != MICSTASY_RAMP_AMPLITUDE){
+		error(MICSTASY_ERROR_ARGUMENT, "Error: unknown ramp curve");
 		return -1;
 	}
 
-	micstasy_set_oscillator(cMicstasy, 0); /* disable oscillator by default */
+	ramp = (struct micstasy_ramp *) calloc(1, sizeof(struct micstasy_ramp));
+	if(ramp == NULL)
+		return error(MICSTASY_ERROR_SYSTEM, "Error: out of memory");
+
+	ramp->unit = cMicstasy;
+	ramp->channel = channel;
+	ramp->to = gain_step(targetDb);
+	ramp->curve = curve;
+	ramp->duration = (uint64_t)durationMs*1000;
+
+	mutex_lock(&bus->lock);
+	for(running = bus->ramps; running != NULL && (running->unit != cMicstasy || running->channel != channel); running = running->next);
+	if(running != NULL) {
+		ramp->from = running->sent;
+		ramp->parameters = running->parameters;
+	}
+	mutex_unlock(&bus->lock);
 
-	for(channel=1; channel <= 8; channel++) {
+	/* otherwise start from the unit's gain, read only once per ramp */
+	if(running == NULL)
+	{
+		if(read_registers(cMicstasy, registers, BIT(gainRegister) | BIT(parameterRegister)) == -1) {
+			free(ramp);
+			return -1;
+		}
 
+		if(registers[gainRegister] == -1 || registers[parameterRegister] == -1) {
+			free(ramp);
+			return error(MICSTASY_ERROR_RESPONSE, "Error: gain registers missing from the response");
+		}
 
-		ret = fscanf(stateFile, "%d \n", &gainCoarse);
-		
-		ret = fscanf(stateFile, "%d %d %d %d \n", &gainFine, &digitalOutSelect, &autoSetLink, &displayAutoDark);
+		ramp->from = registers[gainRegister]*2 + (registers[parameterRegister] & BIT(0));
+		ramp->parameters = registers[parameterRegister] & writable_bits(parameterRegister) & ~BIT(0);
+	}
 
-		ret = fscanf(stateFile, "%d %d %d %d %d %d \n", &input, &HiZ, &loCut, &MS, &phase, &p48);
+	ramp->sent = ramp->from;
+	ramp->start = clock_us();
 
-	
-		micstasy_set_gainCoarse(cMicstasy, channel, gainCoarse);
-		micstasy_set_parameters(cMicstasy, channel, gainFine, displayAutoDark, autoSetLink, digitalOutSelect);
-		micstasy_set_settings(cMicstasy, channel, input, HiZ, autoset, loCut, MS, phase, p48);
+	mutex_lock(&bus->lock);
 
-		if(DEBUG) {
-			printf("channel: %d\n", channel);
-			printf("gainCoarse: %d\n\n", gainCoarse);
-			printf("gainFine: %d\n digitalOutSelect: %d\nautoSetLink: %d\n displayAutoDark: %d\n\n", gainFine, digitalOutSelect, autoSetLink, displayAutoDark);
-			printf("input: %d\n HiZ: %d\n loCut: %d\n MS: %d\n Phase: %d\n p48: %d\n\n", input, HiZ, loCut, MS, phase, p48);
+	if(scheduler_start(bus) == -1) {
+		mutex_unlock(&bus->lock);
+		free(ramp);
+		return -1;
+	}
 
-		}
+	ramp_remove(bus, cMicstasy, channel);
 
-	}
+	ramp->next = bus->ramps;
+	bus->ramps = ramp;
+	bus->rampDue = ramp->start;
 
+	cond_broadcast(&bus->scheduleCond);
+	mutex_unlock(&bus->lock);
 
-	ret = fscanf(stateFile, "%d %d %d %d %d %d %d %d %d %d \n",
-	&intFreq, &clockRange, &clockSelect, &analogOutput, &lockKeys, &peakHold, &followClock, &autosetLimit, &delayCompensation, &autoDevice);
+	return 1;
+}
 
-	ret = micstasy_setup(cMicstasy, intFreq, clockRange, clockSelect, analogOutput, lockKeys, peakHold, followClock, autosetLimit, delayCompensation, autoDevice);
 
-	fclose(stateFile);
+/* stops a ramp where it is, the gain stays at the last step sent */
+int micstasy_ramp_stop(struct micstasy *cMicstasy, int channel)
+{
+	struct micstasy_bus *bus = cMicstasy->bus;
+	int found;
 
-	return ret;
+	mutex_lock(&bus->lock);
+	found = ramp_remove(bus, cMicstasy, channel);
+	mutex_unlock(&bus->lock);
+
+	if(!found)
+		return error(MICSTASY_ERROR_NOT_FOUND, "Error: no gain ramp running on this channel");
+
+	return 1;
 }
 
-int micstasy_set_gain(struct micstasy *cMicstasy, int channel, double dbValue)
+
+/* 1 while a ramp is running on the channel, else 0 */
+int micstasy_ramp_active(struct micstasy *cMicstasy, int channel)
 {
-	boolean gainFine;
-	struct micstasy_parameters parameters;	
-	int ret;
+	struct micstasy_bus *bus = cMicstasy->bus;
+	struct micstasy_ramp *ramp;
 
-	if(channel < 1 || channel > 8){
-		error("Error: channel out of range (1..8)");
-		return -1;
-	}
+	mutex_lock(&bus->lock);
+	for(ramp = bus->ramps; ramp != NULL && (ramp->unit != cMicstasy || ramp->channel != channel); ramp = ramp->next);
+	mutex_unlock(&bus->lock);
 
-	if( dbValue-(int)dbValue >= 0.75) {
-		ret = micstasy_set_gainCoarse(cMicstasy, channel, (int)dbValue+1);
-		gainFine = 0;
+	return ramp != NULL;
+}
+
+
+static void scheduler_thread_stop(struct micstasy_bus *bus)
+{
+	struct micstasy_scheduled *item;
+	struct micstasy_ramp *ramp;
+
+	mutex_lock(&bus->lock);
+	if(bus->schedulerRunning) {
+		bus->schedulerRunning = 0;
+		cond_broadcast(&bus->scheduleCond);
+		mutex_unlock(&bus->lock);
+		thread_join(bus->schedulerThread);
+		mutex_lock(&bus->lock);
 	}
-	else if( dbValue-(int)dbValue < 0.25) {
-		ret = micstasy_set_gainCoarse(cMicstasy, channel, (int)dbValue);
-		gainFine = 0;
+
+	/* output not due yet is dropped, ramps stop where they are */
+	while((item = bus->schedule) != NULL) {
+		bus->schedule = item->next;
+		free(item->values);
+		free(item);
 	}
-	else {
-		
-		ret = micstasy_set_gainCoarse(cMicstasy, channel, (int)dbValue);
-		gainFine = 1;
+	while((ramp = bus->ramps) != NULL) {
+		bus->ramps = ramp->next;
+		free(ramp);
 	}
-	if(ret == -1) return -1;
+	mutex_unlock(&bus->lock);
+}
 
-	ret = micstasy_get_parameters(cMicstasy, channel, &parameters);	
-	if(ret == -1) return -1;
 
-	ret = micstasy_set_parameters(cMicstasy, channel, gainFine, parameters.displayAutoDark, parameters.autoSetLink, parameters.digitalOutSelect);	
+/* drops the scheduled output of a unit that is about to be freed */
+static void schedule_forget_unit(struct micstasy *cMicstasy)
+{
+	struct micstasy_bus *bus = cMicstasy->bus;
+	struct micstasy_scheduled **position, *item;
+	struct micstasy_ramp **ramp, *next;
 
-	return ret;
+	mutex_lock(&bus->lock);
+
+	while(bus->scheduleUnit == cMicstasy)
+		cond_wait_until(&bus->scheduleCond, &bus->lock, clock_us() + RECEIVER_WAKEUP_US);
+
+	for(position = &bus->schedule; *position != NULL; )
+		if((*position)->unit == cMicstasy) {
+			item = *position;
+			*position = item->next;
+			free(item->values);
+			free(item);
+		}
+		else
+			position = &(*position)->next;
+
+	for(ramp = &bus->ramps; *ramp != NULL; )
+		if((*ramp)->unit == cMicstasy) {
+			next = (*ramp)->next;
+			free(*ramp);
+			*ramp = next;
+		}
+		else
+			ramp = &(*ramp)->next;
+
+	mutex_unlock(&bus->lock);
 }
 
 
 int micstasy_close(struct micstasy *cMicstasy)
 {
-	Pm_Close(cMicstasy->portMidiStreamIn);
-	Pm_Close(cMicstasy->portMidiStreamOut);
-	cbFree(&cMicstasy->readBuffer);
+	struct micstasy_bus *bus = cMicstasy->bus;
+	struct micstasy **unit;
+
+	/* a handle from micstasy_init() owns its port pair */
+	if(cMicstasy->ownsBus)
+		return micstasy_bus_close(bus);
+
+	/* also waits for a poll of the meter thread still using the unit */
+	micstasy_meter_stream_stop(cMicstasy);
+
+	async_forget_unit(cMicstasy);
+	schedule_forget_unit(cMicstasy);
+
+	mutex_lock(&bus->lock);
+	for(unit = &bus->units; *unit != NULL; unit = &(*unit)->next)
+		if(*unit == cMicstasy) {
+			*unit = cMicstasy->next;
+			break;
+		}
+	mutex_unlock(&bus->lock);
+
+	mutex_destroy(&cMicstasy->lock);
 	free(cMicstasy);
 
 	return 1;
@@ -991,9 +4887,13 @@ int micstasy_close(struct micstasy *cMicstasy)
 /* circular buffer */
   
 void cbInit(CircularBuffer *cb, int size) {
-	cb->size  = size + 1; 
+	cb->size  = 1;
+	while(cb->size < (uint32_t)size)
+		cb->size <<= 1;
+	cb->mask  = cb->size - 1;
 	cb->start = 0;
 	cb->end   = 0;
+	cb->overflows = 0;
 	cb->elems = (PmEvent *)calloc(cb->size, sizeof(PmEvent));
 }
  
@@ -1004,7 +4904,7 @@ void cbFree(CircularBuffer *cb)
  
 int cbIsFull(CircularBuffer *cb) 
 {
-	return (cb->end + 1) % cb->size == cb->start;
+	return cb->end - cb->start == cb->size;
 }
  
 int cbIsEmpty(CircularBuffer *cb) 
@@ -1012,18 +4912,62 @@ int cbIsEmpty(CircularBuffer *cb)
 	return cb->end == cb->start;
 }
  
-void cbWrite(CircularBuffer *cb, PmEvent *elem) 
+/* returns -1 and counts an overflow instead of overwriting unread events */
+int cbWrite(CircularBuffer *cb, PmEvent *elem) 
 {
-	cb->elems[cb->end] = *elem;
-	cb->end = (cb->end + 1) % cb->size;
-	if (cb->end == cb->start)
-		cb->start = (cb->start + 1) % cb->size; 
+	if (cbIsFull(cb)) {
+		cb->overflows++;
+		return -1;
+	}
+
+	cb->elems[cb->end & cb->mask] = *elem;
+	memory_barrier();
+	cb->end++;
+
+	return 1;
 }
  
 void cbRead(CircularBuffer *cb, PmEvent *elem) 
 {
-	*elem = cb->elems[cb->start];
-	cb->start = (cb->start + 1) % cb->size;
+	memory_barrier();
+	*elem = cb->elems[cb->start & cb->mask];
+	memory_barrier();
+	cb->start++;
+}
+ 
+/* reads pending events from source straight into the free space of the
+   ring, one read (e.g. Pm_Read) per contiguous span; returns the number of events */
+int cbFill(CircularBuffer *cb, int (*read)(void *source, PmEvent *buffer, int length), void *source)
+{
+	uint32_t end = cb->end;
+	uint32_t space = cb->size - (end - cb->start);
+	uint32_t span;
+	int count = 0, n;
+
+	while(space > 0)
+	{
+		span = cb->size - (end & cb->mask);
+		if (span > space)
+			span = space;
+
+		n = read(source, &cb->elems[end & cb->mask], span);
+		if (n == pmBufferOverflow)
+			cb->overflows++;
+		if (n <= 0)
+			break;
+
+		end += n;
+		space -= n;
+		count += n;
+
+		memory_barrier();
+		cb->end = end;
+
+		if ((uint32_t)n < span)
+			break;
+	}
+
+	return count;
 }
  
 
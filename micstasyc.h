@@ -12,6 +12,21 @@
 
 	#include <portmidi.h>
 	#include <stdint.h>
+	#include <stdio.h>
+
+	#ifdef _WIN32
+		#include <windows.h>
+		typedef HANDLE micstasy_thread;
+		typedef CRITICAL_SECTION micstasy_mutex;
+		typedef CONDITION_VARIABLE micstasy_cond;
+	#else
+		#include <unistd.h>
+		#include <pthread.h>
+		#define Sleep(x) usleep((x)*1000)
+		typedef pthread_t micstasy_thread;
+		typedef pthread_mutex_t micstasy_mutex;
+		typedef pthread_cond_t micstasy_cond;
+	#endif
 
 
 	#define SYS_EX_HEADER (int8_t)0xF0
@@ -29,18 +44,83 @@
 	#define MESSAGETYPE_RESPONSE_LEVELMETER_DATA	(int8_t)0x31
 
 	#define BANK_NUMBER_BROADCAST	(int8_t)0x7E
+	#define ADDRESS_BROADCAST	(int8_t)0x7F	/* bank 7, device ID F: all units */
 
 	#define is_real_time_msg(msg)   ((0xF0 & Pm_MessageStatus(msg)) == 0xF8)
 
 	#define BUF_SIZE 200
 
+	/* error codes, see micstasy_errorCode() */
+	#define MICSTASY_OK 0
+	#define MICSTASY_ERROR_ARGUMENT 1	/* argument out of range */
+	#define MICSTASY_ERROR_TIMEOUT 2	/* no response from the unit */
+	#define MICSTASY_ERROR_RESPONSE 3	/* malformed or unexpected response */
+	#define MICSTASY_ERROR_MIDI 4		/* PortMidi failed */
+	#define MICSTASY_ERROR_FILE 5
+	#define MICSTASY_ERROR_STATE 6		/* not possible in the current configuration */
+	#define MICSTASY_ERROR_NOT_FOUND 7
+	#define MICSTASY_ERROR_SYSTEM 8		/* threads, memory */
+	#define READ_BUFFER_SIZE 256	/* PmEvents, power of two */
+
+	#define MICSTASY_SCENE_MAGIC "MCSY"
+	#define MICSTASY_SCENE_VERSION 1
+	#define MICSTASY_SCENE_NAME_LENGTH 32
+	#define MICSTASY_SCENE_MAX_UNITS 8
+	#define MICSTASY_SCENE_REGISTERS 0x1A	/* channel 1..8 and setup 1/2, no lock/sync */
+
+	#define MICSTASY_DEFAULT_TIMEOUT 4000	/* ms */
+
+	#define MICSTASY_TRACE_MAGIC "MCTR"
+	#define MICSTASY_TRACE_VERSION 1
+	#define MICSTASY_TRACE_OUT 0		/* record direction: sent to the units */
+	#define MICSTASY_TRACE_IN 1		/* received from the units */
+
+	#define MICSTASY_REGISTER_COUNT 0x1B	/* channel 1..8 (3 each), setup 1, setup 2, lock/sync */
+
+	#define MICSTASY_PIPELINE_WINDOW 4	/* suggested number of requests in flight */
+
+	/* parameter/value pairs per SET_VALUE message. The library itself always
+	   sent one pair per message, which is what the units are known to
+	   accept; lists of pairs have only been checked against the simulator.
+	   So the default stays at one, micstasy_set_max_pairs() raises it up to
+	   MICSTASY_MAX_SET_PAIRS for units verified to take longer lists */
+	#define MICSTASY_DEFAULT_SET_PAIRS 1
+	#define MICSTASY_MAX_SET_PAIRS 32	/* size of the message buffer */
+
+	/* gain ramp curves, see micstasy_ramp_gain() */
+	#define MICSTASY_RAMP_LINEAR 0		/* dB change linearly in time */
+	#define MICSTASY_RAMP_SCURVE 1		/* raised cosine, eases in and out */
+	#define MICSTASY_RAMP_AMPLITUDE 2	/* amplitude changes linearly in time */
+
+	#define MICSTASY_METER_RING_SIZE 256	/* level meter frames per unit, power of two */
+
+	#define MICSTASY_STATS_BUCKETS 24	/* latency histogram, bucket n: 2^n..2^(n+1)-1 us */
+
+	/* operations with a latency histogram in struct micstasy_stats */
+	#define MICSTASY_STAT_REQUEST 0		/* value request until its response */
+	#define MICSTASY_STAT_LEVELMETER 1	/* level meter request until its response */
+	#define MICSTASY_STAT_SET 2		/* handing a SET_VALUE message to the port */
+	#define MICSTASY_STAT_PIPELINE 3	/* a whole micstasy_pipeline() batch */
+	#define MICSTASY_STAT_SCHEDULE 4	/* how late scheduled output started */
+	#define MICSTASY_STAT_OPERATIONS 5
+
+	#define MICSTASY_TRANSPORT_CHUNK 256	/* bytes per transport read */
+	#define MICSTASY_LOOPBACK_SIZE 4096	/* bytes queued in a loopback, power of two */
+
+	#define MICSTASY_MAX_SYSEX_LENGTH 128
+	#define MICSTASY_INBOX_DEPTH 32
+
 	typedef int8_t boolean;
 
 
+	/* single producer / single consumer event ring; size is a power of two
+	   and start/end run freely, masked on access */
 	typedef struct {
-		int         size;  
-		int         start;
-		int         end;
+		uint32_t    size;  
+		uint32_t    mask;
+		volatile uint32_t start;	/* advanced by the consumer */
+		volatile uint32_t end;		/* advanced by the producer */
+		volatile uint32_t overflows;	/* events lost, here or in PortMidi's queue */
 		PmEvent   *elems; 
 	} CircularBuffer;
 
@@ -49,16 +129,192 @@
 	void cbFree(CircularBuffer *cb);
 	int cbIsFull(CircularBuffer *cb);
 	int cbIsEmpty(CircularBuffer *cb);
-	void cbWrite(CircularBuffer *cb, PmEvent *elem); 
+	int cbWrite(CircularBuffer *cb, PmEvent *elem); 
 	void cbRead(CircularBuffer *cb, PmEvent *elem);
+	int cbFill(CircularBuffer *cb, int (*read)(void *source, PmEvent *buffer, int length), void *source);
+
+
+	struct micstasy_sysex {
+		int length;
+		PmTimestamp timestamp;		/* ms, bus clock, when the EOX arrived */
+		int8_t data[MICSTASY_MAX_SYSEX_LENGTH];
+	};
+
+	/* incremental sysex reassembly, survives messages split across reads */
+	struct micstasy_sysexParser {
+		int length;			/* bytes collected, 0: waiting for SYS_EX_HEADER */
+		boolean overflow;		/* message too long, skipping to EOX */
+		int8_t data[MICSTASY_MAX_SYSEX_LENGTH];
+	};
+
+	struct micstasy_histogram {
+		uint64_t count;
+		uint64_t totalUs;
+		uint64_t maxUs;
+		uint64_t buckets[MICSTASY_STATS_BUCKETS];	/* bucket 0 includes 0 us, the last one everything longer */
+	};
+
+	/* per bus, see micstasy_get_stats() */
+	struct micstasy_stats {
+		struct micstasy_histogram latency[MICSTASY_STAT_OPERATIONS];
+		uint64_t timeouts;		/* requests that got no response */
+		uint64_t retries;		/* requests sent again after a timeout */
+		uint64_t readOverflows;		/* input lost by the transport (queue or ring full) */
+		uint64_t incomplete;		/* sysex cut short by another status byte or too long */
+		uint64_t discarded;		/* complete sysex nobody waited for: no response, stale, inbox full */
+		uint64_t scheduleErrors;	/* scheduled output or ramp steps that could not be sent */
+		uint64_t rampSteps;		/* 0.5 dB steps sent by gain ramps */
+		uint64_t rampStepsSkipped;	/* ramp steps coalesced while the link was busy */
+		uint64_t messagesSent;
+		uint64_t messagesReceived;	/* complete sysex */
+		uint64_t bytesSent;
+		uint64_t bytesReceived;
+	};
+
+	/* the port pair behind a bus. write_sysex sends one F0..F7 message and
+	   returns 1 or a PmError. read copies up to length received bytes and
+	   returns their number, 0 when nothing is pending, -1 on error; it stops
+	   after an EOX, so *timestamp (ms on the micstasy_clock_us() clock, when
+	   the last byte arrived) dates whole messages. poll returns 1 when read
+	   has data. wait, fd and overflows may be NULL */
+	struct micstasy_transport {
+		const char *name;
+		int (*write_sysex)(void *port, const unsigned char *msg);
+		int (*read)(void *port, unsigned char *buffer, int length, PmTimestamp *timestamp);
+		int (*poll)(void *port);
+		int (*wait)(void *port, uint64_t deadline);	/* until input or deadline (us), returns poll() */
+		int (*fd)(void *port);			/* pollable descriptor of the input, -1: none */
+		uint32_t (*overflows)(void *port);	/* input lost so far */
+		int (*close)(void *port);
+	};
+
+	/* in-memory transport: injected bytes, and with echo the written ones,
+	   come back as input */
+	struct micstasy_loopback {
+		boolean echo;
+		micstasy_mutex lock;		/* guards everything below */
+		uint32_t head, tail;
+		uint32_t overflows;		/* bytes lost to a full queue */
+		PmTimestamp time[MICSTASY_LOOPBACK_SIZE];
+		unsigned char data[MICSTASY_LOOPBACK_SIZE];
+	};
+
+	struct micstasy;
+	struct micstasy_job;
+	struct micstasy_scheduled;
+	struct micstasy_ramp;
+	struct micstasy_sim;
+
+	struct micstasy_meterFrame {
+		uint64_t timestamp;		/* us (micstasy_clock_us) when the request went out */
+		int channel[8];			/* dB, as in micstasy_levelMeterData */
+	};
+
+	/* runs on the meter thread of the bus, which waits for it before
+	   micstasy_meter_stream_stop() or micstasy_close() of the unit return;
+	   so it must not call either of them itself */
+	typedef void (*micstasy_meter_callback)(struct micstasy *cMicstasy, const struct micstasy_meterFrame *frame, void *userData);
+
+	/* one MIDI port pair shared by all units daisy-chained on it */
+	struct micstasy_bus {
+		const struct micstasy_transport *transport;
+		void *port;			/* owned by transport, closed with the bus */
+		struct micstasy_sysexParser parser;	/* used by the reader role only */
+		micstasy_mutex sendLock;
+		int setPairs;			/* pairs per SET_VALUE message, see micstasy_set_max_pairs */
+
+		micstasy_mutex statsLock;	/* guards stats */
+		struct micstasy_stats stats;
+		uint32_t readOverflowsReset;	/* transport overflows at the last reset */
+
+		micstasy_mutex traceLock;	/* guards trace and traceTime */
+		FILE *trace;			/* micstasy_trace_start */
+		uint64_t traceTime;		/* us, last record */
+
+		micstasy_mutex lock;		/* guards everything below */
+		micstasy_cond cond;		/* signalled when the inbox or the reader changes */
+		boolean reading;		/* a foreground waiter is reading the input */
+		struct micstasy *units;
+
+		/* replies read from the input, oldest first, until a waiter takes them */
+		int inboxCount;
+		struct micstasy_sysex inbox[MICSTASY_INBOX_DEPTH];
+
+		/* background receiver (micstasy_receiver_start) owns the input */
+		volatile boolean receiverRunning;
+		micstasy_thread receiverThread;
+
+		/* polls the level meters of all streaming units */
+		volatile boolean meterRunning;
+		boolean meterStopping;		/* meterThread is being joined */
+		micstasy_thread meterThread;
+		micstasy_cond meterCond;	/* a poll finished or the thread was joined */
 
+		/* runs micstasy_async_x operations in order, guarded by lock */
+		struct micstasy_job *jobs, *jobsTail;		/* queued */
+		struct micstasy_job *completed, *completedTail;	/* for micstasy_async_poll */
+		struct micstasy *asyncUnit;	/* unit of the running job */
+		int asyncToken;			/* last token handed out */
+		volatile boolean asyncRunning;
+		micstasy_thread asyncThread;
+		micstasy_cond asyncCond;	/* job queued, finished or completed */
 
+		/* sends micstasy_schedule_x output and gain ramps, guarded by lock */
+		struct micstasy_scheduled *schedule;	/* earliest first */
+		int scheduleId;			/* last id handed out */
+		struct micstasy_ramp *ramps;	/* running gain ramps, sent by the scheduler */
+		uint64_t rampDue;		/* us, next ramp update */
+		struct micstasy *scheduleUnit;	/* unit of the output being sent */
+		volatile boolean schedulerRunning;
+		micstasy_thread schedulerThread;
+		micstasy_cond scheduleCond;	/* output queued or sent */
+	};
+
+
+	/* thread safety: handles may be used from different threads at the same
+	   time, on one bus or several; the bus serializes access to the ports.
+	   The error state (micstasy_errorCode/-Message) is per thread.
+	   Calls on one handle from several threads are safe, but read-modify-write
+	   operations (e.g. micstasy_set_gain, micstasy_setup) are not atomic
+	   against each other, so drive each unit from a single thread.
+	   micstasy_close() and micstasy_bus_close() must not race other calls on
+	   the handles they free. */
 	struct micstasy {
 		int8_t bankNumber;
 		int8_t deviceID;
-		PortMidiStream *portMidiStreamIn;
-		PortMidiStream *portMidiStreamOut;
-		CircularBuffer readBuffer;
+		struct micstasy_bus *bus;
+		boolean ownsBus;		/* created by micstasy_init() */
+		struct micstasy *next;		/* next unit on the bus */
+		int timeout;			/* ms to wait for a response */
+		int retries;			/* extra attempts after a timeout */
+		micstasy_mutex lock;		/* guards the shadow cache and channelParameters, taken after bus->lock, never before */
+
+		/* optional write-through copy of the device registers */
+		boolean shadowEnabled;
+		int shadowTimeout;		/* ms, 0 = never stale */
+		uint32_t shadowValid;		/* bit n set: shadow[n] is known */
+		uint64_t shadowTime;		/* us, last refresh from the device */
+		int8_t shadow[MICSTASY_REGISTER_COUNT];
+
+		/* writable bits of the parameters registers as last written or
+		   read, kept with the cache disabled too, so micstasy_set_gain
+		   does not have to read them back. micstasy_cache_invalidate()
+		   forgets them, e.g. after changes on the front panel */
+		uint8_t channelParametersKnown;	/* bit n set: channelParameters[n] is known */
+		int8_t channelParameters[8];
+
+		/* level meter streaming (micstasy_meter_stream_start), lock-free
+		   single producer (meter thread) / single consumer ring */
+		volatile boolean meterStreaming;
+		uint64_t meterPeriod;		/* us */
+		uint64_t meterDue;		/* us, next poll */
+		micstasy_meter_callback meterCallback;
+		int meterBusy;			/* polls of the meter thread using the unit, guarded by bus->lock */
+		void *meterUserData;
+		volatile uint32_t meterHead;	/* written by the meter thread */
+		volatile uint32_t meterTail;	/* written by the consumer */
+		volatile uint32_t meterDropped;	/* frames lost to a full ring */
+		struct micstasy_meterFrame meterFrames[MICSTASY_METER_RING_SIZE];
 	};
 
 	struct micstasy_setup {
@@ -110,8 +366,158 @@
 		int channel[8];
 	};
 
+	struct micstasy_state {
+		int gainCoarse[8];
+		struct micstasy_parameters parameters[8];
+		struct micstasy_settings settings[8];
+		struct micstasy_setup setup;
+		struct micstasy_locksyncInfo locksyncInfo;
+	};
+
+	struct micstasy_value {
+		int8_t parameterNumber;
+		int8_t value;
+	};
+
+	/* binary scene file: header followed by sceneCount fixed size scene records,
+	   so scene N is found at sizeof(header) + N*sceneSize without any parsing */
+	struct micstasy_sceneFileHeader {
+		char magic[4];			/* MICSTASY_SCENE_MAGIC */
+		uint8_t version;		/* MICSTASY_SCENE_VERSION */
+		uint8_t reserved;
+		uint8_t sceneSize[2];		/* bytes per scene record, little endian */
+		uint8_t sceneCount[4];		/* little endian */
+	};
+
+	struct micstasy_sceneUnit {
+		uint8_t address;		/* (bankNumber<<4) | deviceID */
+		int8_t registers[MICSTASY_SCENE_REGISTERS];
+	};
+
+	struct micstasy_scene {
+		char name[MICSTASY_SCENE_NAME_LENGTH];
+		uint8_t unitCount;
+		struct micstasy_sceneUnit units[MICSTASY_SCENE_MAX_UNITS];
+	};
+
+	/* traffic trace file: header followed by records of
+	   direction (1 byte), us since the previous record (varint), length
+	   (varint) and the bytes as they crossed the transport. Varints hold 7
+	   bits per byte, least significant first, high bit set: more follow */
+	struct micstasy_traceFileHeader {
+		char magic[4];			/* MICSTASY_TRACE_MAGIC */
+		uint8_t version;		/* MICSTASY_TRACE_VERSION */
+		uint8_t reserved[3];
+	};
+
+	struct micstasy_traceRecord {
+		int direction;			/* MICSTASY_TRACE_OUT / _IN */
+		uint64_t time;			/* us since the trace started */
+		int length;
+		const unsigned char *data;
+	};
+
+	/* a trace file read by micstasy_trace_load() */
+	struct micstasy_trace {
+		int recordCount;
+		struct micstasy_traceRecord *records;
+		unsigned char *data;		/* file contents, records point into it */
+	};
+
+	struct micstasy_replayResult {
+		int messagesSent;		/* outbound messages replayed */
+		int repliesTaken;		/* recorded replies the request logic received */
+		int repliesMissed;		/* recorded replies it timed out on */
+		int unanswered;			/* requests that had no reply in the trace either */
+		uint32_t mismatches;		/* messages sent that differ from the recording */
+		uint64_t elapsedUs;
+		struct micstasy_stats stats;	/* of the replay bus */
+	};
+
+	/* a scene file mapped into memory by micstasy_scenes_open() */
+	struct micstasy_sceneLibrary {
+		const uint8_t *data;
+		size_t size;
+		int sceneCount;
+	};
+
+	/* async operations, see micstasy_async_x(). They run one after the
+	   other on a single worker thread per bus, in submission order: a unit
+	   that does not answer holds up the jobs of every other unit on the
+	   same bus for its timeout (and retries). Waits only overlap across
+	   buses; batch requests to several units with micstasy_pipeline() */
+	#define MICSTASY_ASYNC_GET_GAIN 1
+	#define MICSTASY_ASYNC_SET_GAIN 2
+	#define MICSTASY_ASYNC_GET_GAINCOARSE 3
+	#define MICSTASY_ASYNC_SET_GAINCOARSE 4
+	#define MICSTASY_ASYNC_GET_PARAMETERS 5
+	#define MICSTASY_ASYNC_SET_PARAMETERS 6
+	#define MICSTASY_ASYNC_GET_SETTINGS 7
+	#define MICSTASY_ASYNC_SET_SETTINGS 8
+	#define MICSTASY_ASYNC_GET_SETUP 9
+	#define MICSTASY_ASYNC_SET_SETUP 10
+	#define MICSTASY_ASYNC_GET_LOCKSYNCINFO 11
+	#define MICSTASY_ASYNC_GET_LEVELMETERDATA 12
+	#define MICSTASY_ASYNC_SCENE_APPLY 13
+
+	struct micstasy_completion {
+		int token;			/* as returned by micstasy_async_x() */
+		int operation;			/* MICSTASY_ASYNC_x */
+		struct micstasy *unit;
+		int channel;			/* 0 for unit wide operations */
+		int status;			/* 1 = done, -1 = failed */
+		int errorCode;			/* MICSTASY_OK or MICSTASY_ERROR_x */
+		const char *errorMessage;
+		void *userData;
+		union {				/* argument of a set, result of a get */
+			double gain;
+			int gainCoarse;
+			struct micstasy_parameters parameters;
+			struct micstasy_settings settings;
+			struct micstasy_setup setup;
+			struct micstasy_locksyncInfo locksyncInfo;
+			struct micstasy_levelMeterData levelMeterData;
+			struct {
+				const struct micstasy_scene *scene;	/* must stay valid until completion */
+				boolean delta;
+			} sceneApply;
+		} value;
+	};
+
+	/* runs on the bus worker thread and must not close its unit or bus;
+	   completions without a callback are queued for micstasy_async_poll()
+	   / micstasy_async_wait() instead */
+	typedef void (*micstasy_async_callback)(const struct micstasy_completion *completion);
+
+	/* one entry of a micstasy_pipeline() batch */
+	struct micstasy_request {
+		int8_t messageType;		/* MESSAGETYPE_REQUEST_VALUE or MESSAGETYPE_REQUEST_LEVELMETER_DATA */
+		int8_t bankNumber;
+		int8_t deviceID;
+		int status;			/* 1 = answered, -1 = failed */
+		struct micstasy_state state;	/* reply to REQUEST_VALUE */
+		struct micstasy_levelMeterData levelMeterData;	/* reply to REQUEST_LEVELMETER_DATA */
+	};
+
+
+	#ifdef __cplusplus
+	extern "C" {
+	#endif
 
 	struct micstasy *micstasy_init(int midiDeviceIn, int midiDeviceOut, int bankNumber, int deviceID);
+	struct micstasy_bus *micstasy_bus_open(int midiDeviceIn, int midiDeviceOut);
+	struct micstasy_bus *micstasy_bus_open_transport(const struct micstasy_transport *transport, void *port);
+	struct micstasy_bus *micstasy_bus_open_rawmidi(const char *device);
+	struct micstasy_bus *micstasy_bus_open_loopback(boolean echo);
+	int micstasy_loopback_inject(struct micstasy_bus *bus, const unsigned char *bytes, int length);
+	int micstasy_bus_fd(struct micstasy_bus *bus);
+	int micstasy_trace_start(struct micstasy_bus *bus, const char *filePath);
+	int micstasy_trace_stop(struct micstasy_bus *bus);
+	struct micstasy_trace *micstasy_trace_load(const char *filePath);
+	int micstasy_trace_free(struct micstasy_trace *trace);
+	int micstasy_replay(const char *filePath, boolean realtime, int timeoutMs, struct micstasy_replayResult *result);
+	struct micstasy *micstasy_bus_unit(struct micstasy_bus *bus, int bankNumber, int deviceID);
+	int micstasy_bus_close(struct micstasy_bus *bus);
 
 	char *micstasy_list_midiDevices();
 	int micstasy_get_levelMeterData(struct micstasy *cMicstasy, struct micstasy_levelMeterData *levelMeterData);
@@ -127,22 +533,84 @@
 			 int analogOutput, boolean lockKeys, boolean peakHold, boolean followClock, int autosetLimit, boolean delayCompensation, boolean autoDevice);
 	int micstasy_get_setup(struct micstasy *cMicstasy, struct micstasy_setup *setup);
 	int micstasy_get_locksyncInfo(struct micstasy *cMicstasy, struct micstasy_locksyncInfo *synclock);
+	int micstasy_get_state(struct micstasy *cMicstasy, struct micstasy_state *state);
+	int micstasy_pipeline(struct micstasy *cMicstasy, struct micstasy_request *requests, int count, int window);
+	int micstasy_set_values(struct micstasy *cMicstasy, const struct micstasy_value *values, int count);
+	int micstasy_set_timeout(struct micstasy *cMicstasy, int timeoutMs);
+	int micstasy_set_retries(struct micstasy *cMicstasy, int retries);
+	int micstasy_set_max_pairs(struct micstasy_bus *bus, int pairs);
+	int micstasy_receiver_start(struct micstasy *cMicstasy);
+	int micstasy_receiver_stop(struct micstasy *cMicstasy);
+	int micstasy_cache_enable(struct micstasy *cMicstasy, int timeoutMs);
+	int micstasy_cache_disable(struct micstasy *cMicstasy);
+	int micstasy_cache_invalidate(struct micstasy *cMicstasy);
+	int micstasy_cache_refresh(struct micstasy *cMicstasy);
 	int micstasy_set_bankdevID(struct micstasy *cMicstasy, int8_t bankID, int8_t devID);
 	int micstasy_set_oscillator(struct micstasy *cMicstasy, int channel);
 	int micstasy_memory_save(struct micstasy *cMicstasy, int slot);
 	int micstasy_memory_recall(struct micstasy *cMicstasy, int slot);
 	int micstasy_store_state(struct micstasy *cMicstasy, char *filePath);
 	int micstasy_restore_state(struct micstasy *cMicstasy, char *filePath);
+	int micstasy_restore_state_delta(struct micstasy *cMicstasy, char *filePath, boolean verify); /* returns registers written */
 	int micstasy_set_gain(struct micstasy *cMicstasy, int channel, double dbValue);
-	int micstasy_close(struct micstasy *cMicstasy);
-	char *micstasy_errorMessage(void);
+	int micstasy_scene_capture(struct micstasy *cMicstasy, struct micstasy_scene *scene);
+	int micstasy_scene_apply(struct micstasy *cMicstasy, const struct micstasy_scene *scene, boolean delta);
+	int micstasy_scenes_save(char *filePath, const struct micstasy_scene *scene); /* returns scene index */
+	struct micstasy_sceneLibrary *micstasy_scenes_open(char *filePath);
+	const struct micstasy_scene *micstasy_scenes_get(struct micstasy_sceneLibrary *library, int index);
+	int micstasy_scenes_find(struct micstasy_sceneLibrary *library, const char *name);
+	int micstasy_scenes_close(struct micstasy_sceneLibrary *library);
 
+	/* group operations broadcast to every unit on the bus, also to units
+	   without a micstasy_bus_unit() handle. A broadcast writes whole
+	   registers: the p48, loCut and gain functions merge their bits into
+	   each unit's current register value, so every physical unit needs a
+	   handle, or its other bits of that register (phase, MS, mute, autoset,
+	   display ...) are overwritten. When units disagree on those bits, the
+	   largest group of units with the same target value gets one broadcast
+	   and each other unit its own message, briefly taking the broadcast
+	   value first. Memory recall (0x1C) and bank/device ID (0x1D) cannot be
+	   broadcast */
+	int micstasy_group_set_values(struct micstasy_bus *bus, const struct micstasy_value *values, int count);
+	int micstasy_group_set_gainCoarse(struct micstasy_bus *bus, int channel, int dbValue);
+	int micstasy_group_set_gain(struct micstasy_bus *bus, int channel, double dbValue);
+	int micstasy_group_set_p48(struct micstasy_bus *bus, int channel, boolean p48);
+	int micstasy_group_set_loCut(struct micstasy_bus *bus, int channel, boolean loCut);
+	int micstasy_group_set_oscillator(struct micstasy_bus *bus, int channel);
+	int micstasy_meter_stream_start(struct micstasy *cMicstasy, int rateHz, micstasy_meter_callback callback, void *userData);
+	int micstasy_meter_stream_read(struct micstasy *cMicstasy, struct micstasy_meterFrame *frames, int maxFrames);
+	int micstasy_meter_stream_stop(struct micstasy *cMicstasy);
+	uint64_t micstasy_clock_us(void);
+	int micstasy_get_stats(struct micstasy_bus *bus, struct micstasy_stats *stats, boolean reset);
+	uint64_t micstasy_stats_percentile(const struct micstasy_histogram *histogram, double percentile);
+	int micstasy_async_get_gain(struct micstasy *cMicstasy, int channel, micstasy_async_callback callback, void *userData);
+	int micstasy_async_set_gain(struct micstasy *cMicstasy, int channel, double dbValue, micstasy_async_callback callback, void *userData);
+	int micstasy_async_get_gainCoarse(struct micstasy *cMicstasy, int channel, micstasy_async_callback callback, void *userData);
+	int micstasy_async_set_gainCoarse(struct micstasy *cMicstasy, int channel, int dbValue, micstasy_async_callback callback, void *userData);
+	int micstasy_async_get_parameters(struct micstasy *cMicstasy, int channel, micstasy_async_callback callback, void *userData);
+	int micstasy_async_set_parameters(struct micstasy *cMicstasy, const struct micstasy_parameters *parameters, micstasy_async_callback callback, void *userData);
+	int micstasy_async_get_settings(struct micstasy *cMicstasy, int channel, micstasy_async_callback callback, void *userData);
+	int micstasy_async_set_settings(struct micstasy *cMicstasy, const struct micstasy_settings *settings, micstasy_async_callback callback, void *userData);
+	int micstasy_async_get_setup(struct micstasy *cMicstasy, micstasy_async_callback callback, void *userData);
+	int micstasy_async_set_setup(struct micstasy *cMicstasy, const struct micstasy_setup *setup, micstasy_async_callback callback, void *userData);
+	int micstasy_async_get_locksyncInfo(struct micstasy *cMicstasy, micstasy_async_callback callback, void *userData);
+	int micstasy_async_get_levelMeterData(struct micstasy *cMicstasy, micstasy_async_callback callback, void *userData);
+	int micstasy_async_scene_apply(struct micstasy *cMicstasy, const struct micstasy_scene *scene, boolean delta, micstasy_async_callback callback, void *userData);
+	int micstasy_async_poll(struct micstasy_bus *bus, struct micstasy_completion *completion);
+	int micstasy_schedule_values(struct micstasy *cMicstasy, uint64_t when, const struct micstasy_value *values, int count);
+	int micstasy_schedule_scene(struct micstasy *cMicstasy, uint64_t when, const struct micstasy_scene *scene, boolean delta);
+	int micstasy_schedule_cancel(struct micstasy_bus *bus, int id);
+	int micstasy_ramp_gain(struct micstasy *cMicstasy, int channel, double targetDb, int durationMs, int curve);
+	int micstasy_ramp_stop(struct micstasy *cMicstasy, int channel);
+	int micstasy_ramp_active(struct micstasy *cMicstasy, int channel);
+	int micstasy_async_wait(struct micstasy_bus *bus, struct micstasy_completion *completion, int timeoutMs);
+	int micstasy_close(struct micstasy *cMicstasy);
+	char *micstasy_errorMessage(void);		/* of the calling thread, read only */
+	int micstasy_errorCode(void);
+	const char *micstasy_errorString(int code);
 
-	#ifdef _WIN32
-		#include <windows.h>
-	#else
-		#include <unistd.h>
-		#define Sleep(x) usleep((x)*1000)
+	#ifdef __cplusplus
+	}
 	#endif
 
 #endif
@@ -0,0 +1,85 @@
+/*
+  Builds micstasy.hpp as C++20 and drives the simulator through it
+
+  Copyright (c) 2014, Gerrit Wyen <gerrit.wyen@rwth-aachen.de>, Florian Heese <heese@ind.rwth-aachen.de>
+  Institute of Communication Systems and Data Processing
+  RWTH Aachen University, Germany
+
+  usage: micstasypp_test	run by ctest, exits with the number of failed tests
+
+*/
+
+#include <cstdio>
+
+#include "micstasy.hpp"
+#include "micstasysim.h"
+
+#define CHECK(x) do { if(!(x)) { \
+		std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+		failures++; } } while(0)
+
+static int failures = 0;
+
+
+static micstasypp::task<void> set_and_read(micstasypp::unit &unit, double *dbValue)
+{
+	co_await unit.set_gain(2, 31.5);
+	*dbValue = co_await unit.gain(2);
+}
+
+static micstasypp::task<void> bad_channel(micstasypp::unit &unit)
+{
+	co_await unit.gain(9);
+}
+
+
+int main()
+{
+	struct micstasy_simConfig config;
+	struct micstasy_sim *sim;
+	double dbValue = 0;
+	int code = 0;
+
+	micstasy_sim_defaults(&config);
+	config.baudRate = 0;
+	config.processingUs = 100;
+
+	sim = micstasy_sim_open(&config);
+	if(sim == NULL) {
+		std::fprintf(stderr, "unable to open the simulator\n");
+		return 1;
+	}
+	micstasy_sim_add_unit(sim, 0, 0);
+
+	{
+		micstasypp::loop loop;
+		micstasypp::bus bus(micstasy_bus_open_sim(sim));
+		micstasypp::unit unit(loop, bus, 0, 0);
+
+		micstasy_set_timeout(unit.get(), 200);
+
+		loop.spawn(set_and_read(unit, &dbValue));
+		loop.run();
+		CHECK(dbValue == 31.5);
+		CHECK(micstasy_sim_get_register(sim, 0, 0, 3) == 9+31);
+
+		/* an exception a task does not catch comes out of run() */
+		loop.spawn(bad_channel(unit));
+		try {
+			loop.run();
+		}
+		catch(const micstasypp::error &e) {
+			code = e.code();
+		}
+		CHECK(code == MICSTASY_ERROR_ARGUMENT);
+
+		/* and only once */
+		loop.run();
+	}
+
+	micstasy_sim_close(sim);
+
+	std::printf("micstasypp: %s\n", failures ? "FAILED" : "ok");
+
+	return failures;
+}
@@ -0,0 +1,449 @@
+/*
+  In-process Micstasy simulator for tests and benchmarks without MIDI hardware
+
+  Copyright (c) 2014, Gerrit Wyen <gerrit.wyen@rwth-aachen.de>, Florian Heese <heese@ind.rwth-aachen.de>
+  Institute of Communication Systems and Data Processing
+  RWTH Aachen University, Germany
+
+  Answers SET_VALUE, REQUEST_VALUE and REQUEST_LEVELMETER_DATA like a chain of
+  units would. Requests occupy the host to device wire for their length at the
+  configured baud rate, responses leave after the turnaround (plus jitter) and
+  reach the host one byte time apart. The host only sees bytes whose time has
+  come. Buses reach it through micstasy_sim_transport.
+
+*/
+
+#include "micstasysim.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define SIM_PI 3.14159265358979
+
+
+static void sim_lock(struct micstasy_sim *sim)
+{
+#ifdef _WIN32
+	EnterCriticalSection(&sim->lock);
+#else
+	pthread_mutex_lock(&sim->lock);
+#endif
+}
+
+static void sim_unlock(struct micstasy_sim *sim)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(&sim->lock);
+#else
+	pthread_mutex_unlock(&sim->lock);
+#endif
+}
+
+
+/* deterministic per simulator, unlike rand() */
+static uint32_t sim_random(struct micstasy_sim *sim)
+{
+	sim->random = sim->random * 1103515245 + 12345;
+
+	return (sim->random >> 8) & 0xFFFFFF;
+}
+
+static int sim_drop(struct micstasy_sim *sim)
+{
+	return sim->config.dropRate > 0 && sim_random(sim) < sim->config.dropRate * 0x1000000;
+}
+
+static uint64_t sim_byte_us(struct micstasy_sim *sim)
+{
+	return sim->config.baudRate > 0 ? 10000000 / sim->config.baudRate : 0;
+}
+
+
+void micstasy_sim_defaults(struct micstasy_simConfig *config)
+{
+	config->baudRate = MICSTASY_SIM_BAUD_RATE;
+	config->processingUs = 500;
+	config->jitterUs = 0;
+	config->dropRate = 0;
+	config->seed = 1;
+}
+
+
+struct micstasy_sim *micstasy_sim_open(const struct micstasy_simConfig *config)
+{
+	struct micstasy_sim *sim;
+
+	sim = (struct micstasy_sim *) calloc(1, sizeof(struct micstasy_sim));
+	if(sim == NULL)
+		return NULL;
+
+	if(config != NULL)
+		sim->config = *config;
+	else
+		micstasy_sim_defaults(&sim->config);
+
+	sim->random = sim->config.seed;
+
+#ifdef _WIN32
+	InitializeCriticalSection(&sim->lock);
+#else
+	pthread_mutex_init(&sim->lock, NULL);
+#endif
+
+	return sim;
+}
+
+
+int micstasy_sim_add_unit(struct micstasy_sim *sim, int bankNumber, int deviceID)
+{
+	int address = (bankNumber<<4) | deviceID;
+	struct micstasy_simUnit *unit;
+	int i;
+
+	if(bankNumber < 0 || bankNumber > 7 || deviceID < 0 || deviceID > 7)
+		return -1;
+
+	unit = (struct micstasy_simUnit *) calloc(1, sizeof(struct micstasy_simUnit));
+	if(unit == NULL)
+		return -1;
+
+	/* factory state: 0 dB gain everywhere, internal clock locked */
+	for(i=0; i<8; i++)
+		unit->registers[i*3] = 9;
+	unit->registers[0x1A] = 0x00;
+
+	sim_lock(sim);
+	free(sim->units[address]);
+	sim->units[address] = unit;
+	sim_unlock(sim);
+
+	return 1;
+}
+
+
+int micstasy_sim_get_register(struct micstasy_sim *sim, int bankNumber, int deviceID, int parameterNumber)
+{
+	int address = (bankNumber<<4) | deviceID;
+	int value = -1;
+
+	if(address < 0 || address >= MICSTASY_SIM_ADDRESSES || parameterNumber < 0 || parameterNumber > 0x1E)
+		return -1;
+
+	sim_lock(sim);
+	if(sim->units[address] != NULL)
+		value = sim->units[address]->registers[parameterNumber];
+	sim_unlock(sim);
+
+	return value;
+}
+
+
+int micstasy_sim_set_register(struct micstasy_sim *sim, int bankNumber, int deviceID, int parameterNumber, int8_t value)
+{
+	int address = (bankNumber<<4) | deviceID;
+	int ret = -1;
+
+	if(address < 0 || address >= MICSTASY_SIM_ADDRESSES || parameterNumber < 0 || parameterNumber > 0x1E)
+		return -1;
+
+	sim_lock(sim);
+	if(sim->units[address] != NULL) {
+		sim->units[address]->registers[parameterNumber] = value;
+		ret = 1;
+	}
+	sim_unlock(sim);
+
+	return ret;
+}
+
+
+int micstasy_sim_close(struct micstasy_sim *sim)
+{
+	int i;
+
+	for(i=0; i<MICSTASY_SIM_ADDRESSES; i++)
+		free(sim->units[i]);
+
+#ifdef _WIN32
+	DeleteCriticalSection(&sim->lock);
+#else
+	pthread_mutex_destroy(&sim->lock);
+#endif
+	free(sim);
+
+	return 1;
+}
+
+
+/* synthetic signal: every channel sweeps the 14 meter steps at its own rate */
+static int8_t sim_meter(int channel, uint64_t time)
+{
+	double t = time / 1000000.0;
+	double level = 0.5 + 0.5*sin(2*SIM_PI*(0.5 + 0.25*channel)*t + channel);
+
+	return (int8_t)(level*13 + 0.5);
+}
+
+
+/* queues a response; called with sim->lock held */
+static void sim_respond(struct micstasy_sim *sim, const uint8_t *msg, int length, uint64_t start)
+{
+	uint64_t byteUs = sim_byte_us(sim);
+	uint64_t time;
+	int i;
+
+	if(sim->inFree > start)
+		start = sim->inFree;
+
+	for(i=0; i<length; i++)
+	{
+		time = start + (i+1)*byteUs;
+
+		if(sim_drop(sim))
+			continue;
+
+		if(sim->head - sim->tail == MICSTASY_SIM_QUEUE_SIZE) {
+			sim->overflows++;
+			continue;
+		}
+
+		sim->queue[sim->head & (MICSTASY_SIM_QUEUE_SIZE-1)].time = time;
+		sim->queue[sim->head & (MICSTASY_SIM_QUEUE_SIZE-1)].data = msg[i];
+		sim->head++;
+	}
+
+	sim->inFree = start + length*byteUs;
+}
+
+
+static void sim_set_value(struct micstasy_sim *sim, int address, int parameterNumber, int8_t value)
+{
+	struct micstasy_simUnit *unit = sim->units[address];
+	int newAddress;
+
+	if(parameterNumber < 0 || parameterNumber > 0x1E)
+		return;
+
+	switch(parameterNumber)
+	{
+		case 0x1B: /* memory save, 0 = idle */
+			if(value >= 1 && value <= MICSTASY_SIM_MEMORY_SLOTS)
+				memcpy(unit->memory[value-1], unit->registers, MICSTASY_REGISTER_COUNT);
+			return;
+
+		case 0x1C: /* memory recall, lock/sync status stays live */
+			if(value >= 1 && value <= MICSTASY_SIM_MEMORY_SLOTS)
+				memcpy(unit->registers, unit->memory[value-1], 0x1A);
+			return;
+
+		case 0x1D: /* new bank/device ID */
+			newAddress = value;
+			if(newAddress < 0 || newAddress >= MICSTASY_SIM_ADDRESSES || sim->units[newAddress] != NULL)
+				return;
+			sim->units[newAddress] = unit;
+			sim->units[address] = NULL;
+			return;
+	}
+
+	/* the level meter bits of the parameters register are read only */
+	if(parameterNumber < 0x18 && parameterNumber%3 == 1)
+		value = (value & 0x43) | (unit->registers[parameterNumber] & ~0x43);
+
+	unit->registers[parameterNumber] = value;
+}
+
+
+static void sim_answer(struct micstasy_sim *sim, int address, int messageType, uint64_t start)
+{
+	struct micstasy_simUnit *unit = sim->units[address];
+	uint8_t msg[8 + 2*MICSTASY_REGISTER_COUNT];
+	int i, length = 0;
+
+	msg[length++] = 0xF0;
+	msg[length++] = 0x00;
+	msg[length++] = 0x20;
+	msg[length++] = 0x0D;
+	msg[length++] = 0x68;
+	msg[length++] = address;
+
+	if(messageType == MESSAGETYPE_REQUEST_VALUE)
+	{
+		msg[length++] = MESSAGETYPE_RESPONSE_VALUE;
+
+		for(i=0; i<8; i++)
+			unit->registers[i*3+1] = (unit->registers[i*3+1] & 0x43) | (sim_meter(i, start) << 2);
+
+		for(i=0; i<MICSTASY_REGISTER_COUNT; i++) {
+			msg[length++] = i;
+			msg[length++] = unit->registers[i] & 0x7F;
+		}
+	}
+	else
+	{
+		msg[length++] = MESSAGETYPE_RESPONSE_LEVELMETER_DATA;
+
+		for(i=0; i<8; i++)
+			msg[length++] = sim_meter(i, start);
+	}
+
+	msg[length++] = 0xF7;
+
+	sim_respond(sim, msg, length, start);
+}
+
+
+int micstasy_sim_write_sysex(struct micstasy_sim *sim, const unsigned char *msg)
+{
+	uint64_t now = micstasy_clock_us();
+	uint64_t start;
+	int length, address, i, lost = 0;
+
+	for(length=0; length < MICSTASY_MAX_SYSEX_LENGTH && msg[length] != 0xF7; length++);
+	if(length == MICSTASY_MAX_SYSEX_LENGTH)
+		return -1;
+	length++;
+
+	sim_lock(sim);
+
+	/* the request is seen once its last byte is through */
+	if(sim->outFree < now)
+		sim->outFree = now;
+	sim->outFree += length*sim_byte_us(sim);
+
+	for(i=0; i<length; i++)
+		if(sim_drop(sim))
+			lost = 1;
+
+	/* a unit ignores corrupted or foreign messages */
+	if(lost || length < 8 || msg[1] != 0x00 || msg[2] != 0x20 || msg[3] != 0x0D || msg[4] != 0x68) {
+		sim_unlock(sim);
+		return 1;
+	}
+
+	start = sim->outFree + sim->config.processingUs;
+	if(sim->config.jitterUs > 0)
+		start += sim_random(sim) % (sim->config.jitterUs+1);
+
+	for(address=0; address<MICSTASY_SIM_ADDRESSES; address++)
+	{
+		if(sim->units[address] == NULL || (msg[5] != address && msg[5] != ADDRESS_BROADCAST))
+			continue;
+
+		switch(msg[6])
+		{
+			case MESSAGETYPE_SET_VALUE:
+				for(i=7; i+1 < length-1; i+=2)
+					if(sim->units[address] != NULL)
+						sim_set_value(sim, address, msg[i], msg[i+1]);
+				break;
+
+			case MESSAGETYPE_REQUEST_VALUE:
+			case MESSAGETYPE_REQUEST_LEVELMETER_DATA:
+				sim_answer(sim, address, msg[6], start);
+				break;
+		}
+	}
+
+	sim_unlock(sim);
+
+	return 1;
+}
+
+
+/* 1 when the oldest queued byte has reached the host. Called with sim->lock held */
+static int sim_arrived(struct micstasy_sim *sim, uint64_t now)
+{
+	return sim->tail != sim->head && sim->queue[sim->tail & (MICSTASY_SIM_QUEUE_SIZE-1)].time <= now;
+}
+
+
+int micstasy_sim_poll(struct micstasy_sim *sim)
+{
+	int ready;
+
+	sim_lock(sim);
+	ready = sim_arrived(sim, micstasy_clock_us());
+	sim_unlock(sim);
+
+	return ready;
+}
+
+
+/* arrived bytes up to and including the first EOX */
+int micstasy_sim_read(struct micstasy_sim *sim, unsigned char *buffer, int length, PmTimestamp *timestamp)
+{
+	uint64_t now = micstasy_clock_us();
+	struct micstasy_simByte *byte;
+	int count = 0;
+
+	sim_lock(sim);
+
+	while(count < length && sim_arrived(sim, now))
+	{
+		byte = &sim->queue[sim->tail & (MICSTASY_SIM_QUEUE_SIZE-1)];
+		buffer[count++] = byte->data;
+		*timestamp = (PmTimestamp)(byte->time/1000);
+		sim->tail++;
+
+		if(byte->data == 0xF7)
+			break;
+	}
+
+	sim_unlock(sim);
+
+	return count;
+}
+
+
+static int sim_transport_write_sysex(void *port, const unsigned char *msg)
+{
+	return micstasy_sim_write_sysex((struct micstasy_sim *)port, msg) == 1 ? 1 : pmBadData;
+}
+
+static int sim_transport_read(void *port, unsigned char *buffer, int length, PmTimestamp *timestamp)
+{
+	return micstasy_sim_read((struct micstasy_sim *)port, buffer, length, timestamp);
+}
+
+static int sim_transport_poll(void *port)
+{
+	return micstasy_sim_poll((struct micstasy_sim *)port);
+}
+
+static uint32_t sim_transport_overflows(void *port)
+{
+	struct micstasy_sim *sim = (struct micstasy_sim *)port;
+	uint32_t overflows;
+
+	sim_lock(sim);
+	overflows = sim->overflows;
+	sim_unlock(sim);
+
+	return overflows;
+}
+
+/* the simulator belongs to the caller */
+static int sim_transport_close(void *port)
+{
+	(void)port;
+
+	return 1;
+}
+
+const struct micstasy_transport micstasy_sim_transport = {
+	"sim",
+	sim_transport_write_sysex,
+	sim_transport_read,
+	sim_transport_poll,
+	NULL,
+	NULL,
+	sim_transport_overflows,
+	sim_transport_close
+};
+
+
+struct micstasy_bus *micstasy_bus_open_sim(struct micstasy_sim *sim)
+{
+	return micstasy_bus_open_transport(&micstasy_sim_transport, sim);
+}
@@ -0,0 +1,74 @@
+/*
+  In-process Micstasy simulator for tests and benchmarks without MIDI hardware
+
+  Copyright (c) 2014, Gerrit Wyen <gerrit.wyen@rwth-aachen.de>, Florian Heese <heese@ind.rwth-aachen.de>
+  Institute of Communication Systems and Data Processing
+  RWTH Aachen University, Germany
+
+*/
+
+#ifndef MICSTASYSIM_H
+	#define MICSTASYSIM_H
+
+	#include "micstasyc.h"
+
+	#define MICSTASY_SIM_BAUD_RATE 31250	/* MIDI */
+	#define MICSTASY_SIM_QUEUE_SIZE 8192	/* bytes on the way to the host, power of two */
+	#define MICSTASY_SIM_MEMORY_SLOTS 8
+	#define MICSTASY_SIM_ADDRESSES 0x78	/* bank 0..7, device 0..7 */
+
+	#ifdef __cplusplus
+	extern "C" {
+	#endif
+
+	struct micstasy_simConfig {
+		int baudRate;			/* bytes take 10 bits on the wire, 0: no wire delay */
+		int processingUs;		/* device turnaround from request to response */
+		int jitterUs;			/* random extra turnaround, 0..jitterUs */
+		double dropRate;		/* probability that a byte is lost, either direction */
+		unsigned int seed;		/* for jitter and drops */
+	};
+
+	struct micstasy_simUnit {
+		int8_t registers[0x1F];
+		int8_t memory[MICSTASY_SIM_MEMORY_SLOTS][MICSTASY_REGISTER_COUNT];
+	};
+
+	struct micstasy_simByte {
+		uint64_t time;			/* us (micstasy_clock_us), when it reaches the host */
+		uint8_t data;
+	};
+
+	struct micstasy_sim {
+		struct micstasy_simConfig config;
+		struct micstasy_simUnit *units[MICSTASY_SIM_ADDRESSES];
+		micstasy_mutex lock;		/* guards everything below */
+		uint32_t random;
+		uint64_t outFree;		/* us, host to device wire idle again */
+		uint64_t inFree;		/* us, device to host wire idle again */
+		uint32_t head, tail;
+		uint32_t overflows;		/* bytes lost to a full queue */
+		struct micstasy_simByte queue[MICSTASY_SIM_QUEUE_SIZE];
+	};
+
+	void micstasy_sim_defaults(struct micstasy_simConfig *config);
+	struct micstasy_sim *micstasy_sim_open(const struct micstasy_simConfig *config); /* NULL: defaults */
+	int micstasy_sim_add_unit(struct micstasy_sim *sim, int bankNumber, int deviceID);
+	int micstasy_sim_get_register(struct micstasy_sim *sim, int bankNumber, int deviceID, int parameterNumber);
+	int micstasy_sim_set_register(struct micstasy_sim *sim, int bankNumber, int deviceID, int parameterNumber, int8_t value);
+	int micstasy_sim_close(struct micstasy_sim *sim);
+
+	/* a bus talking to the simulator, which is not owned and must outlive it */
+	struct micstasy_bus *micstasy_bus_open_sim(struct micstasy_sim *sim);
+
+	/* the port side, a struct micstasy_transport */
+	extern const struct micstasy_transport micstasy_sim_transport;
+	int micstasy_sim_write_sysex(struct micstasy_sim *sim, const unsigned char *msg);
+	int micstasy_sim_read(struct micstasy_sim *sim, unsigned char *buffer, int length, PmTimestamp *timestamp);
+	int micstasy_sim_poll(struct micstasy_sim *sim);
+
+	#ifdef __cplusplus
+	}
+	#endif
+
+#endif